@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+// Keeps the arrays of destroyed or grown tables for new tables of the same
+// size to reuse, skipping the allocation and, since HashSet resets an array's
+// control bytes to Empty as it hands it back, the initializing memset too.
+// Arrays are pooled by exact size: tables that start at the same capacity
+// grow through the same sizes, so their arrays line up.
+//
+// Tables use a pool through PooledAllocator; the pool must outlive them. It
+// is safe to share between threads.
+class ArrayPool {
+ public:
+  // Arrays kept per size; more are freed.
+  explicit ArrayPool(size_t maxPerSize = 16) : _maxPerSize(maxPerSize) {}
+
+  ArrayPool(ArrayPool const&) = delete;
+  ArrayPool& operator=(ArrayPool const&) = delete;
+
+  ~ArrayPool() {
+    for (auto& [size, arrays] : _free) {
+      for (std::byte* data : arrays) {
+        ::operator delete(data);
+      }
+    }
+  }
+
+  // A pooled array of `size` bytes, or nullptr.
+  std::byte* take(size_t size) {
+    std::lock_guard const guard{_lock};
+    auto it = _free.find(size);
+    if (it == _free.end() || it->second.empty()) {
+      return nullptr;
+    }
+    std::byte* data = it->second.back();
+    it->second.pop_back();
+    return data;
+  }
+
+  // Whether put() would keep an array of `size` bytes right now. Another
+  // thread may fill the room before it does.
+  bool has_room(size_t size) {
+    std::lock_guard const guard{_lock};
+    auto it = _free.find(size);
+    return it == _free.end() || it->second.size() < _maxPerSize;
+  }
+
+  // Keep `data`, of `size` bytes, unless there are enough of that size.
+  bool put(std::byte* data, size_t size) {
+    std::lock_guard const guard{_lock};
+    std::vector<std::byte*>& arrays = _free[size];
+    if (arrays.size() == _maxPerSize) {
+      return false;
+    }
+    arrays.push_back(data);
+    return true;
+  }
+
+ private:
+  size_t const _maxPerSize;
+  std::mutex _lock;
+  std::unordered_map<size_t, std::vector<std::byte*>> _free;
+};
+
+// Allocates from the global heap, and recycles through an ArrayPool (see
+// HashSet::RecyclingAllocator).
+template <typename T>
+struct PooledAllocator {
+  using value_type = T;
+
+  explicit PooledAllocator(ArrayPool* pool) : pool(pool) {}
+  template <typename U>
+  PooledAllocator(PooledAllocator<U> const& other) : pool(other.pool) {}
+
+  T* allocate(size_t count) {
+    return static_cast<T*>(::operator new(count * sizeof(T)));
+  }
+
+  void deallocate(T* data, size_t) { ::operator delete(data); }
+
+  T* take_recycled(size_t count) {
+    return reinterpret_cast<T*>(pool->take(count * sizeof(T)));
+  }
+
+  bool can_recycle(size_t count) { return pool->has_room(count * sizeof(T)); }
+
+  bool recycle(T* data, size_t count) {
+    return pool->put(reinterpret_cast<std::byte*>(data), count * sizeof(T));
+  }
+
+  template <typename U>
+  bool operator==(PooledAllocator<U> const& other) const {
+    return pool == other.pool;
+  }
+
+  ArrayPool* pool;
+};
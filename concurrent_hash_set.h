@@ -0,0 +1,65 @@
+#pragma once
+
+#include <array>
+#include <mutex>
+
+#include "hash_set.h"
+
+// A thread-safe HashSet made of 2^ShardBits independent shards, each a
+// HashSet behind its own lock. Keys are routed to shards by the hash bits the
+// shards themselves never look at, so every shard still sees well spread
+// groups and control tags.
+template <typename V, size_t ShardBits = 6>
+struct ConcurrentHashSet {
+  using Table = HashSet<V>;
+  static_assert(ShardBits <= Table::TagShift - Table::RoutingShift,
+                "not enough routing bits for this many shards");
+  static constexpr size_t ShardCount = size_t(1) << ShardBits;
+
+  bool insert(V v) {
+    Shard& shard = _shardFor(v.hash());
+    std::lock_guard guard{shard.lock};
+    return shard.set.insert(std::move(v));
+  }
+
+  bool contains(V const& v) const {
+    size_t const hash = v.hash();
+    Shard const& shard = _shardFor(hash);
+    std::lock_guard guard{shard.lock};
+    return shard.set.contains(typename Table::ProbeToken{hash}, v);
+  }
+
+  bool erase(V const& v) {
+    Shard& shard = _shardFor(v.hash());
+    std::lock_guard guard{shard.lock};
+    return shard.set.erase(v);
+  }
+
+  // The number of entries. Only exact while no other thread is mutating.
+  size_t size() const {
+    size_t result = 0;
+    for (Shard const& shard : _shards) {
+      std::lock_guard guard{shard.lock};
+      result += shard.set.size();
+    }
+    return result;
+  }
+
+ private:
+  // Each shard gets its own cache line(s) so that threads working on
+  // different shards don't contend on a shared line for their locks.
+  struct alignas(64) Shard {
+    mutable std::mutex lock;
+    Table set;
+  };
+
+  std::array<Shard, ShardCount> _shards;
+
+  Shard& _shardFor(size_t hash) {
+    return _shards[(hash >> (Table::TagShift - ShardBits)) & (ShardCount - 1)];
+  }
+
+  Shard const& _shardFor(size_t hash) const {
+    return _shards[(hash >> (Table::TagShift - ShardBits)) & (ShardCount - 1)];
+  }
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <algorithm>
+#include <cinttypes>
+#include <span>
+
+#include "hash_set.h"
+
+// Counts occurrences of keys. Each increment is a single upsert probe into a
+// flat HashSet of (key, count) entries.
+template <typename K, typename Count = uint64_t>
+struct CountingHashMap {
+  // How many keys increment_batch() stages per upsert_batch() call.
+  static constexpr size_t BatchSize = 64;
+
+  struct Entry {
+    K key;
+    Count count;
+
+    // Entries are identified by their key alone.
+    bool operator==(Entry const& other) const { return key == other.key; }
+    size_t hash() const noexcept { return key.hash(); }
+  };
+
+  CountingHashMap(size_t initialCapacity = 4) : _set(initialCapacity) {}
+
+  // Count one more occurrence of `key` and return its new count.
+  Count increment(K const& key) {
+    Count result = 1;
+    _set.upsert(Entry{key, 1}, [&](Entry& entry) { result = ++entry.count; });
+    return result;
+  }
+
+  // Count one more occurrence of each of `keys`, prefetching ahead through
+  // HashSet::upsert_batch().
+  void increment_batch(std::span<K const> keys) {
+    Entry staged[BatchSize];
+    for (size_t first = 0; first < keys.size(); first += BatchSize) {
+      size_t const n = std::min(BatchSize, keys.size() - first);
+      for (size_t i = 0; i < n; ++i) {
+        staged[i] = Entry{keys[first + i], 1};
+      }
+      _set.upsert_batch(std::span<Entry const>(staged, n),
+                        [](Entry& entry) { ++entry.count; });
+    }
+  }
+
+  // How many times `key` has been counted.
+  Count count(K const& key) const {
+    Entry const* entry = _set.find(Entry{key, 0});
+    return entry != nullptr ? entry->count : 0;
+  }
+
+  // The number of distinct keys.
+  size_t size() const { return _set.size(); }
+
+ private:
+  HashSet<Entry> _set;
+};
@@ -6,6 +6,10 @@ struct Data {
   int y;
   double z;
 
+  // Data stays out of is_bitwise_comparable, so its 16-byte single-compare
+  // fast path never applies: 0.0 and -0.0 compare equal as z but differ in
+  // their bytes, and a NaN z never compares equal, whatever its bits.
+
   bool operator==(Data const& other) const {
     return other.x == x && other.y == y && other.z == z;
   }
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cinttypes>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Epoch based reclamation. Readers pin the current epoch while they use shared
+// objects; a writer that unpublishes an object retires it, and the object is
+// freed once every reader that could still see it has unpinned.
+//
+// The protocol: a reader stores the epoch it saw into its slot, then loads the
+// shared pointer. A writer swaps the pointer, then retires the old object,
+// which advances the epoch. Any reader pinned at a later epoch loaded the
+// pointer after the swap, so the old object may be freed once every pinned
+// slot is past the epoch it was retired in. All of this is seq_cst.
+//
+// Pins nest: a thread that pins while already pinned, e.g. a reader calling
+// back into the structure it is reading, keeps its outer epoch, and stays
+// pinned until its outermost Guard is destroyed.
+struct EpochDomain {
+  // How many threads may be registered with epoch domains at once.
+  static constexpr size_t MaxThreads = 256;
+
+ private:
+  struct Slot;
+
+ public:
+
+  // Keeps the calling thread's epoch pinned until destroyed, or until the
+  // outermost of its nested Guards is.
+  struct Guard {
+    explicit Guard(Slot& slot) : _slot(&slot) {}
+    Guard(Guard&& other) : _slot(std::exchange(other._slot, nullptr)) {}
+    Guard(Guard const&) = delete;
+    ~Guard() {
+      if (_slot != nullptr && --_slot->depth == 0) {
+        _slot->epoch.store(Unpinned, std::memory_order_release);
+      }
+    }
+
+   private:
+    Slot* _slot;
+  };
+
+  EpochDomain() : _epoch(1), _slots(MaxThreads) {}
+
+  ~EpochDomain() {
+    for (Retired& retired : _retired) {
+      retired.destroy(retired.ptr);
+    }
+  }
+
+  Guard pin() {
+    Slot& slot = _slots[_threadIndex()];
+    if (slot.depth++ == 0) {
+      assert(slot.epoch.load(std::memory_order_relaxed) == Unpinned);
+      slot.epoch.store(_epoch.load());
+    }
+    return Guard{slot};
+  }
+
+  // Free `ptr` with delete once no reader can still be using it. Only call
+  // this after `ptr` can no longer be loaded by new readers.
+  template <typename T>
+  void retire(T* ptr) {
+    std::lock_guard guard{_retireLock};
+    _retired.push_back(
+        {ptr, [](void* p) { delete static_cast<T*>(p); }, _epoch.fetch_add(1)});
+    _reclaim();
+  }
+
+  // Free whatever retired objects no reader can see any more.
+  void reclaim() {
+    std::lock_guard guard{_retireLock};
+    _reclaim();
+  }
+
+ private:
+  static constexpr uint64_t Unpinned = 0;
+
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> epoch{Unpinned};
+    // How many Guards the owning thread holds; only it touches this.
+    size_t depth = 0;
+  };
+
+  struct Retired {
+    void* ptr;
+    void (*destroy)(void*);
+    uint64_t epoch;
+  };
+
+  std::atomic<uint64_t> _epoch;
+  std::vector<Slot> _slots;
+  std::mutex _retireLock;
+  std::vector<Retired> _retired;
+
+  void _reclaim() {
+    uint64_t oldestPinned = UINT64_MAX;
+    for (Slot const& slot : _slots) {
+      uint64_t const epoch = slot.epoch.load();
+      if (epoch != Unpinned) {
+        oldestPinned = std::min(oldestPinned, epoch);
+      }
+    }
+    auto const freeable = [&](Retired const& retired) {
+      return retired.epoch < oldestPinned;
+    };
+    for (Retired& retired : _retired) {
+      if (freeable(retired)) {
+        retired.destroy(retired.ptr);
+      }
+    }
+    std::erase_if(_retired, freeable);
+  }
+
+  // A small per-thread index into the slots, handed back when the thread
+  // exits so that short-lived threads don't use up the slots.
+  static size_t _threadIndex() {
+    static std::atomic<bool> used[MaxThreads];
+    struct Registration {
+      size_t index = 0;
+      Registration() {
+        while (used[index].exchange(true)) {
+          index++;
+          assert(index < MaxThreads);
+        }
+      }
+      ~Registration() { used[index].store(false); }
+    };
+    thread_local Registration registration;
+    return registration.index;
+  }
+};
@@ -1,9 +1,25 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <bit>
 #include <boost/tti/has_member_function.hpp>
+#include <cassert>
 #include <cinttypes>
+#include <concepts>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <memory>
+#include <memory_resource>
 #include <optional>
+#include <ranges>
+#include <span>
+#include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -19,64 +35,375 @@ BOOST_TTI_HAS_MEMBER_FUNCTION(print);
 enum class Control : uint8_t {
   Empty   = 0b1111'1111,
   Removed = 0b1000'0000,
+  Busy    = 0b1111'1110, // claimed, entry being written (InsertOnlyHashSet)
   // Full = 0b0...'....
 };
 // clang-format on
 
-template <typename V, size_t GrowthFactor = 2>
+// Opt-in trait for key types whose equality is exactly equality of their
+// bytes. For such types of 8, 16 or 32 bytes, candidates that match on their
+// control byte are compared with one SIMD compare over the whole key instead of
+// operator==. A type opts in either by specializing this trait or by declaring
+// `static constexpr bool bitwise_comparable = true;`.
+//
+// Only opt in if no two keys that operator== considers equal can differ in
+// their bytes (no padding, no floating point -0.0 vs 0.0, ...), and no key
+// that operator== considers unequal to itself can be looked up (NaN compares
+// equal to a NaN with the same bits).
+template <typename V>
+struct is_bitwise_comparable : std::false_type {};
+
+template <typename V>
+  requires V::bitwise_comparable
+struct is_bitwise_comparable<V> : std::true_type {};
+
+template <typename V>
+inline constexpr bool is_bitwise_comparable_v = is_bitwise_comparable<V>::value;
+
+// The table grows to GrowthFactor times its group count, which may be any
+// factor above 1 (e.g. 1.5): group counts need not be powers of 2.
+// `Allocator` provides the table's memory. Only its rebinding to std::byte is
+// used: the control bytes and slots live in one byte array, which has to be
+// GroupSize aligned. Allocators that take an alignment, like
+// std::pmr::polymorphic_allocator, are asked for it; any other has to align
+// its arrays itself, as std::allocator does.
+template <typename V, double GrowthFactor = 2.0,
+          typename Allocator = std::allocator<std::byte>>
 struct HashSet {
   static constexpr size_t GroupSize = 16;
+  // How many entries ahead the batched operations hash and prefetch.
+  static constexpr size_t PrefetchDistance = 8;
+  // How a hash is used: its top 7 bits, [TagShift, 64), are stored as the
+  // control byte, and the group index comes from the low bits, [0,
+  // RoutingShift). The 7 bits in between are never used by a table, so
+  // callers that spread keys over several tables, like ConcurrentHashSet, can
+  // route on them without skewing the groups.
+  static constexpr unsigned TagShift = 57;
+  static constexpr unsigned RoutingShift = 50;
+  // Grow once the entry count crosses this fraction of the slots.
+  static constexpr double MaxLoadFactor = 0.8;
+  // A parallel _rehash gives each thread at least this many old groups, and a
+  // parallel _allocate at least this many new ones.
+  static constexpr size_t MinGroupsPerRehashThread = 4096;
 
-  HashSet(size_t initialCapacity = 4)
+  // `initThreads` as for set_init_threads, applied to the initial arrays too.
+  HashSet(size_t initialCapacity = 4, size_t initThreads = 1,
+          Allocator const& allocator = Allocator())
       : _count(0),
-        _groupCount(1),
-        _data(std::make_unique<std::byte[]>(
-            (_groupCount * GroupSize) * (1 + sizeof(V))
-            /* [        capacity       ]   [control+value] */
-            )) {
-    std::memset(_data.get(), 0xFF, GroupSize);
-  }
+        _groupCount(_groupsFor(initialCapacity)),
+        _data(_allocate(ByteAllocator(allocator), _groupCount, initThreads)),
+        _initThreads(initThreads),
+        _oldData(nullptr, _data.get_deleter()) {}
+
+  explicit HashSet(Allocator const& allocator) : HashSet(4, 1, allocator) {}
+
+  // A copy has the same groups and slots as the original. Trivially copyable
+  // entries are copied with one memcpy of the control and slot arrays, without
+  // rehashing anything.
+  HashSet(HashSet const& other)
+      : _count(other._count),
+        _groupCount(other._groupCount),
+        _data(_clone(ByteTraits::select_on_container_copy_construction(
+                          other._allocator()),
+                      other._data.get(), other._groupCount)),
+        _rehashThreads(other._rehashThreads),
+        _initThreads(other._initThreads),
+        _migrationGroups(other._migrationGroups),
+        _shrinkLoadFactor(other._shrinkLoadFactor),
+        // from the allocator selected for _data, so that both arrays share
+        // one
+        _oldData(other._oldData == nullptr
+                     ? Buffer(nullptr, _data.get_deleter())
+                     : _clone(_allocator(), other._oldData.get(),
+                              other._oldGroupCount)),
+        _oldGroupCount(other._oldGroupCount),
+        _migrated(other._migrated) {}
+
+  // Moving hands over the arrays together with the allocator they came from.
+  HashSet(HashSet&&) = default;
+  HashSet& operator=(HashSet&&) = default;
 
   bool insert(V v) {
-    if (_count > size_t(_groupCount * GroupSize * 0.8)) {
-      _rehash();
-    }
+    _prepareInsert();
     bool const inserted = _insert(std::move(v), _data);
     assert(inserted);
     _count++;
     return inserted;
   }
 
+  // Grow the table so that it holds `count` entries without rehashing. It
+  // grows by at least GrowthFactor, so that reserving a little more at a time
+  // stays amortized.
+  void reserve(size_t count) {
+    size_t const groupCount = _groupsFor(count);
+    if (groupCount > _groupCount) {
+      _rehash(std::max(groupCount, _grownGroupCount(_groupCount)));
+    }
+  }
+
+  // Shrink the table to the fewest groups that hold its entries, which also
+  // clears every tombstone.
+  void shrink_to_fit() {
+    size_t const groupCount = _groupsFor(_count);
+    if (groupCount < _groupCount) {
+      _rehash(groupCount);
+    }
+  }
+
+  // Bulk load values that are known to be distinct from each other and from
+  // everything already in the table. The table is sized once up front, and
+  // each value goes straight into the first free slot of its probe sequence.
+  // Uniqueness is not checked, except in DEBUG builds.
+  template <std::ranges::sized_range Range>
+  void build_from_unique(Range const& values) {
+    reserve(_count + std::ranges::size(values));
+    for (V const& v : values) {
+#if DEBUG
+      assert(!contains(v));
+#endif
+      bool const inserted = _insert(v, _data);
+      assert(inserted);
+      _count++;
+    }
+  }
+
   bool contains(V const& v) const {
     Control* ctrl;
     V* entry;
-    return _find(v, ctrl, entry);
+    return _find(v, v.hash(), ctrl, entry);
   }
 
-  bool erase(V const& v) {
+  // A key's hash, computed by prefetch(). Carrying it from prefetch() to
+  // contains() or find() lets a caller schedule the memory access of a lookup
+  // well ahead of the lookup itself.
+  struct ProbeToken {
+    size_t hash;
+  };
+
+  // Hash `v` and start loading the first group its lookup will examine. The
+  // token only holds the hash, so it stays correct across mutations; a
+  // mutation in between just means the prefetched group may be the wrong one.
+  ProbeToken prefetch(V const& v) const {
+    size_t const hash = v.hash();
+    _prefetch(hash);
+    return {hash};
+  }
+
+  // contains() for a key already hashed by prefetch(v).
+  bool contains(ProbeToken token, V const& v) const {
     Control* ctrl;
     V* entry;
-    bool const found = _find(v, ctrl, entry);
-    if (!found) {
-      return false;
+    return _find(v, token.hash, ctrl, entry);
+  }
+
+  // find() for a key already hashed by prefetch(v).
+  V const* find(ProbeToken token, V const& v) const {
+    Control* ctrl;
+    V* entry;
+    return _find(v, token.hash, ctrl, entry) ? entry : nullptr;
+  }
+
+  // Get the entry equal to `v`, or nullptr if there is none.
+  V const* find(V const& v) const {
+    Control* ctrl;
+    V* entry;
+    return _find(v, v.hash(), ctrl, entry) ? entry : nullptr;
+  }
+
+  size_t size() const { return _count; }
+
+  // What stats() reports.
+  struct Stats {
+    size_t entries;
+    size_t slots;
+    // Both arrays while an incremental migration is running.
+    size_t bytes_allocated;
+    double bytes_per_entry;
+    double load_factor;
+    // Removed control bytes.
+    size_t tombstones;
+    // How many groups hold 0, 1, ..., GroupSize entries.
+    std::array<size_t, GroupSize + 1> group_occupancy;
+    // Groups with no Empty byte, which every probe reaching them has to
+    // continue past, and groups with nothing but Empty bytes.
+    size_t groups_without_empty;
+    size_t empty_groups;
+    // The longest run of consecutive groups without an Empty byte, i.e. one
+    // less than the most groups a probe can visit.
+    size_t longest_probe_run;
+  };
+
+  // Occupancy statistics, from one pass over the control bytes. While an
+  // incremental migration is running, everything but the entry and byte
+  // counts describes the new array only.
+  Stats stats() const {
+    Stats stats{};
+    stats.entries = _count;
+    stats.slots = _groupCount * GroupSize;
+    size_t const slotBytes = GroupSize * (1 + sizeof(V));
+    stats.bytes_allocated = (_groupCount + _oldGroupCount) * slotBytes;
+    stats.bytes_per_entry =
+        _count == 0 ? 0.0 : double(stats.bytes_allocated) / _count;
+    stats.load_factor = double(_count) / stats.slots;
+    // The run of groups without Empty that starts at group 0, which a probe
+    // wrapping around from the end of the table continues into.
+    size_t leadingRun = 0;
+    size_t run = 0;
+    for (size_t groupIndex = 0; groupIndex < _groupCount; ++groupIndex) {
+      std::byte const* group = _data.get() + groupIndex * GroupSize;
+      int const free = _matchFree(group);
+      int const empty = _matchEmpty(group);
+      // free bytes are Empty or Removed, so the ones that aren't Empty are
+      // tombstones
+      int const full =
+          std::popcount(static_cast<unsigned int>(~free & 0xFFFF));
+      stats.tombstones +=
+          std::popcount(static_cast<unsigned int>(free & ~empty));
+      stats.group_occupancy[full]++;
+      stats.empty_groups += empty == 0xFFFF;
+      if (empty == 0) {
+        stats.groups_without_empty++;
+        stats.longest_probe_run = std::max(stats.longest_probe_run, ++run);
+      } else {
+        if (run == groupIndex) {
+          leadingRun = run;
+        }
+        run = 0;
+      }
     }
+    stats.longest_probe_run =
+        std::min(std::max(stats.longest_probe_run, run + leadingRun),
+                 _groupCount);
+    return stats;
+  }
 
-    _count--;
-    *ctrl = Control::Removed;
+  // Let _rehash split the old groups across up to `threads` threads, counting
+  // the calling one, which waits for the rest to finish.
+  void set_rehash_threads(size_t threads) { _rehashThreads = threads; }
 
-    // We don't actually have to do anything to the erased entry if it's
-    // trivially destructible. Otherwise, run the destructor.
-    if constexpr (!std::is_trivially_destructible_v<V>) {
-      entry->~V();
+  // Initialize new arrays from up to `threads` threads, each writing the
+  // control bytes of a run of groups and faulting in the pages of their slots.
+  // Page faults and zero-filling then happen on several cores, and with a
+  // first-touch NUMA policy the pages spread across those cores' nodes
+  // instead of all landing on the allocating thread's.
+  void set_init_threads(size_t threads) { _initThreads = threads; }
+
+  // Grow incrementally instead of all at once: keep the old array alongside
+  // the new one and have every insert, upsert and erase move
+  // `groupsPerOperation` of its groups across, so that no single operation
+  // pays for the whole rehash. Lookups check both arrays until every group
+  // has moved. 0, the default, grows with one stop-the-world _rehash.
+  void set_incremental_growth(size_t groupsPerOperation) {
+    _migrationGroups = groupsPerOperation;
+  }
+
+  // Halve the table whenever an erase leaves its load factor below
+  // `minLoadFactor`; 0, the default, never shrinks. The floor has to stay
+  // well clear of where the table grows, so that a shrink is never
+  // immediately followed by a grow or the other way around: right after a
+  // shrink the load factor is in [floor, 2 * floor), which is at most
+  // MaxLoadFactor / GrowthFactor, and right after a grow it is about
+  // MaxLoadFactor / GrowthFactor, which is at least twice the floor.
+  void set_shrink_load_factor(double minLoadFactor) {
+    assert(minLoadFactor <= MaxLoadFactor / (2 * GrowthFactor));
+    _shrinkLoadFactor = minLoadFactor;
+  }
+
+  // Call `fn` on every entry, in table order.
+  template <typename Fn>
+  void for_each(Fn&& fn) const {
+    _forEachIn(_data.get(), _groupCount, 0, _groupCount, fn);
+    if (_oldData != nullptr) {
+      _forEachIn(_oldData.get(), _oldGroupCount, 0, _oldGroupCount, fn);
     }
+  }
 
-#if DEBUG
-    // Zero memory out in debug just for debugging help.
-    memset(entry, 0x00, sizeof(V));
-#endif
+  // for_each from up to `threads` threads, each scanning a run of groups, so
+  // `fn` is called concurrently and in no particular order.
+  template <typename Fn>
+  void parallel_for_each(Fn&& fn, size_t threads) const {
+    _parallelScan(threads, [&fn, this](size_t, std::byte const* data,
+                                       size_t groupCount, size_t first,
+                                       size_t last) {
+      _forEachIn(data, groupCount, first, last, fn);
+    });
+  }
+
+  // Fold every entry into a T from up to `threads` threads. Each thread starts
+  // from a copy of `identity` and calls `fn(T& accumulator, V const& entry)`
+  // on the entries of its run of groups; then `combine(T, T)` merges the
+  // threads' accumulators, in no particular order.
+  template <typename T, typename Fn, typename Combine>
+  T parallel_reduce(T const& identity, Fn&& fn, Combine&& combine,
+                    size_t threads) const {
+    threads = _scanThreads(threads);
+    std::vector<T> partials(threads, identity);
+    _parallelScan(threads, [&](size_t worker, std::byte const* data,
+                               size_t groupCount, size_t first, size_t last) {
+      // accumulate locally; neighbouring partials share cache lines
+      T accumulator = std::move(partials[worker]);
+      auto accumulate = [&](V const& v) { fn(accumulator, v); };
+      _forEachIn(data, groupCount, first, last, accumulate);
+      partials[worker] = std::move(accumulator);
+    });
+    T result = std::move(partials[0]);
+    for (size_t worker = 1; worker < threads; ++worker) {
+      result = combine(std::move(result), std::move(partials[worker]));
+    }
+    return result;
+  }
+
+  // Call `fn` on the entry equal to `v` if there is one, or insert `v`
+  // otherwise, in a single probe. `fn` may modify the entry but must not change
+  // its hash or what it compares equal to. Returns whether `v` was inserted.
+  template <typename Fn>
+  bool upsert(V v, Fn&& fn) {
+    size_t const hash = v.hash();
+    return _upsert(std::move(v), hash, fn);
+  }
+
+  // upsert() every value in `values` with the same `fn`, prefetching ahead
+  // like erase_batch(). Returns how many values were inserted.
+  template <typename Fn>
+  size_t upsert_batch(std::span<V const> values, Fn&& fn) {
+    size_t inserted = 0;
+    _pipelined(values, [&](V const& v, size_t hash) {
+      inserted += _upsert(V(v), hash, fn);
+    });
+    return inserted;
+  }
+
+  bool erase(V const& v) {
+    _migrateStep();
+    Control* ctrl;
+    V* entry;
+    bool const found = _find(v, v.hash(), ctrl, entry);
+    if (!found) {
+      return false;
+    }
+    _eraseAt(ctrl, entry);
+    _maybeShrink();
     return true;
   }
 
+  // Erase every value in `values`, returning how many were present. Groups are
+  // prefetched PrefetchDistance entries ahead so that the probes for a batch
+  // overlap their cache misses instead of paying for them one at a time.
+  size_t erase_batch(std::span<V const> values) {
+    size_t erased = 0;
+    _pipelined(values, [&](V const& v, size_t hash) {
+      _migrateStep();
+      Control* ctrl;
+      V* entry;
+      if (_find(v, hash, ctrl, entry)) {
+        _eraseAt(ctrl, entry);
+        erased++;
+      }
+    });
+    _maybeShrink();
+    return erased;
+  }
+
   void print() const {
     printf("Printing contents of hash table:\n");
     printf("group count: %zu, entry count: %zu\n", _groupCount, _count);
@@ -103,26 +430,600 @@ struct HashSet {
     }
   }
 
+  // What precedes the arrays in a save() image. Everything but the counts
+  // describes the layout, so an image only loads into the same one.
+  struct ImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t groupSize;
+    uint32_t entrySize;
+    uint32_t entryAlignment;
+    uint32_t tagShift;
+    uint32_t routingShift;
+    uint64_t groupCount;
+    uint64_t count;
+  };
+
+  // Write the table to `path` as an image of its arrays behind a header
+  // describing their layout, for load() to map straight back without
+  // rehashing. Finishes an incremental migration first. The image uses this
+  // machine's byte order. Returns false if the file could not be written.
+  bool save(char const* path)
+    requires std::is_trivially_copyable_v<V>
+  {
+    _finishMigration();
+    std::FILE* file = std::fopen(path, "wb");
+    if (file == nullptr) {
+      return false;
+    }
+    ImageHeader const header = _imageHeader(_groupCount, _count);
+    size_t const size = (_groupCount * GroupSize) * (1 + sizeof(V));
+    bool const written =
+        std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+        std::fwrite(_data.get(), 1, size, file) == size;
+    return std::fclose(file) == 0 && written;
+  }
+
+  // Read a table written by save(), with one read for the arrays. Returns
+  // nullopt if the file can't be read, was written for a different layout or
+  // entry type, is truncated, or its entries don't hash to where they are
+  // stored (checked on a sample), e.g. because the hash function changed.
+  static std::optional<HashSet> load(char const* path,
+                                     Allocator const& allocator = Allocator())
+    requires std::is_trivially_copyable_v<V>
+  {
+    std::unique_ptr<std::FILE, int (*)(std::FILE*)> file{
+        std::fopen(path, "rb"), &std::fclose};
+    if (file == nullptr) {
+      return std::nullopt;
+    }
+    ImageHeader header;
+    if (std::fread(&header, sizeof(header), 1, file.get()) != 1) {
+      return std::nullopt;
+    }
+    if (!_validHeader(header)) {
+      return std::nullopt;
+    }
+    // Check the length before allocating, so that a damaged group count
+    // can't ask for more memory than the file holds.
+    std::optional<size_t> const imageSize = _imageSize(header.groupCount);
+    struct stat status;
+    if (!imageSize || ::fstat(fileno(file.get()), &status) != 0 ||
+        uint64_t(status.st_size) != *imageSize) {
+      return std::nullopt;
+    }
+    size_t const size = *imageSize - sizeof(header);
+    ByteAllocator bytes(allocator);
+    HashSet set(Buffer{_allocateBytes(bytes, size), Deallocate(bytes, size)},
+                header.groupCount, header.count);
+    if (std::fread(set._data.get(), 1, size, file.get()) != size ||
+        std::fgetc(file.get()) != EOF) {
+      return std::nullopt;
+    }
+    // Check the entry count against the control bytes, and that a sample of
+    // the entries can be found where the current hash function looks.
+    size_t entries = 0;
+    for (size_t groupIndex = 0; groupIndex < set._groupCount; ++groupIndex) {
+      int const full = ~_matchFree(set._data.get() + groupIndex * GroupSize);
+      entries += std::popcount(static_cast<unsigned int>(full & 0xFFFF));
+    }
+    if (entries != set._count ||
+        !_findsSample(set._data.get(), set._groupCount)) {
+      return std::nullopt;
+    }
+    return set;
+  }
+
  private:
+  template <typename>
+  friend struct SingleWriterHashSet;
+  template <typename>
+  friend struct StripedHashSet;
+  template <typename>
+  friend struct InsertOnlyHashSet;
+  template <typename>
+  friend struct MappedHashSet;
+  template <typename>
+  friend struct PersistentHashSet;
+  template <typename>
+  friend struct OutOfLineHashSet;
+
+  using ByteAllocator = typename std::allocator_traits<
+      Allocator>::template rebind_alloc<std::byte>;
+  using ByteTraits = std::allocator_traits<ByteAllocator>;
+
+  // Frees an array from _allocate or _clone with the allocator it came from.
+  struct Deallocate {
+    ByteAllocator allocator;
+    size_t size = 0;
+
+    void operator()(std::byte* data) const {
+      ByteAllocator copy = allocator;
+      if constexpr (RecyclingAllocator) {
+        // Offer the array back with every control byte Empty, so that the
+        // next table to take it needn't initialize it; but only reset it if
+        // the allocator has room to keep it.
+        if (copy.can_recycle(size)) {
+          std::memset(data, 0xFF, size / (1 + sizeof(V)));
+          if (copy.recycle(data, size)) {
+            return;
+          }
+        }
+      }
+      _deallocateBytes(copy, data, size);
+    }
+
+    // Some allocators, like std::pmr::polymorphic_allocator, cannot be
+    // assigned, but an array moved into _data or _oldData has to bring its
+    // allocator along.
+    Deallocate() = default;
+    Deallocate(ByteAllocator allocator, size_t size)
+        : allocator(std::move(allocator)), size(size) {}
+    Deallocate(Deallocate const&) = default;
+    Deallocate& operator=(Deallocate const& other) {
+      if (this != &other) {
+        std::destroy_at(this);
+        std::construct_at(this, other);
+      }
+      return *this;
+    }
+  };
+  using Buffer = std::unique_ptr<std::byte[], Deallocate>;
+
+  // Take over `data`, arrays for `groupCount` groups holding `count`
+  // entries.
+  HashSet(Buffer data, size_t groupCount, size_t count)
+      : _count(count),
+        _groupCount(groupCount),
+        _data(std::move(data)),
+        _oldData(nullptr, _data.get_deleter()) {}
+
   size_t _count;
   size_t _groupCount;
-  std::unique_ptr<std::byte[]> _data;
+  Buffer _data;
+  size_t _rehashThreads = 1;
+  size_t _initThreads = 1;
+  // Incremental growth: how many old groups each operation moves, and while
+  // moving, the old array and the first of its groups not yet moved.
+  size_t _migrationGroups = 0;
+  double _shrinkLoadFactor = 0;
+  Buffer _oldData;
+  size_t _oldGroupCount = 0;
+  size_t _migrated = 0;
 
   static constexpr bool HasPrint =
       has_member_function_print<V const, void>::value;
 
-  void _rehash() {
+  static_assert(GrowthFactor > 1, "the table has to grow when it grows");
+  static_assert(!is_bitwise_comparable_v<V> || std::is_trivially_copyable_v<V>,
+                "bitwise comparable keys must be trivially copyable");
+  // Whether the table grows inside its array: the allocator can extend an
+  // allocation, and entries can be moved as bytes.
+  static constexpr bool InPlaceGrowth =
+      std::is_trivially_copyable_v<V> &&
+      requires(ByteAllocator allocator, std::byte* data, size_t size) {
+        {
+          allocator.reallocate(data, size, size)
+        } -> std::same_as<std::byte*>;
+      };
+  // Whether the allocator recycles arrays: take_recycled(size) returns an
+  // array handed back earlier through recycle(data, size), with its control
+  // bytes still Empty from when it was handed back, or nullptr if it has
+  // none. can_recycle(size) says whether recycle() would keep an array of
+  // that size, so that one it won't is freed without being reset first;
+  // recycle() returns false if it doesn't keep the array after all.
+  static constexpr bool RecyclingAllocator =
+      requires(ByteAllocator allocator, std::byte* data, size_t size) {
+        { allocator.take_recycled(size) } -> std::same_as<std::byte*>;
+        { allocator.can_recycle(size) } -> std::same_as<bool>;
+        { allocator.recycle(data, size) } -> std::same_as<bool>;
+      };
+  // Whether the allocator takes an alignment. std::pmr::polymorphic_allocator
+  // does, and without one only aligns to std::byte.
+  static constexpr bool AligningAllocator =
+      requires(ByteAllocator allocator, void* data, size_t size) {
+        { allocator.allocate_bytes(size, GroupSize) } -> std::same_as<void*>;
+        allocator.deallocate_bytes(data, size, GroupSize);
+      };
+  static constexpr bool BitwiseCompare =
+      is_bitwise_comparable_v<V> &&
+      (sizeof(V) == 8 || sizeof(V) == 16 || sizeof(V) == 32);
+
+  ByteAllocator const& _allocator() const {
+    return _data.get_deleter().allocator;
+  }
+
+  // Allocate `size` bytes for the arrays, GroupSize aligned: _clearSlot finds
+  // a control byte's group by its address, and _insertConcurrent loads
+  // control bytes through atomic_ref<uint64_t>.
+  static std::byte* _allocateBytes(ByteAllocator& allocator, size_t size) {
+    std::byte* bytes;
+    if constexpr (AligningAllocator) {
+      bytes =
+          static_cast<std::byte*>(allocator.allocate_bytes(size, GroupSize));
+    } else {
+      bytes = ByteTraits::allocate(allocator, size);
+    }
+    assert(reinterpret_cast<uintptr_t>(bytes) % GroupSize == 0 &&
+           "the allocator has to align arrays to GroupSize");
+    return bytes;
+  }
+
+  // Free an array from _allocateBytes.
+  static void _deallocateBytes(ByteAllocator& allocator, std::byte* data,
+                               size_t size) {
+    if constexpr (AligningAllocator) {
+      allocator.deallocate_bytes(data, size, GroupSize);
+    } else {
+      ByteTraits::deallocate(allocator, data, size);
+    }
+  }
+
+  // How many entries load() looks up to check the hash function.
+  static constexpr size_t ImageSampleSize = 64;
+
+  // Whether `header` describes an image in this table's layout.
+  static bool _validHeader(ImageHeader const& header) {
+    ImageHeader const expected =
+        _imageHeader(header.groupCount, header.count);
+    return header.groupCount != 0 &&
+           std::memcmp(&header, &expected, sizeof(header)) == 0;
+  }
+
+  // Whether the first ImageSampleSize entries in the arrays at `data`, which
+  // has `groupCount` groups, are where the current hash function looks.
+  static bool _findsSample(std::byte* data, size_t groupCount) {
+    size_t sampled = 0;
+    for (size_t groupIndex = 0;
+         groupIndex < groupCount && sampled < ImageSampleSize; ++groupIndex) {
+      int matches = ~_matchFree(data + groupIndex * GroupSize) & 0xFFFF;
+      for (; matches != 0; matches &= (matches - 1), ++sampled) {
+        int index = std::countr_zero(static_cast<unsigned int>(matches));
+        V const& v = *reinterpret_cast<V const*>(
+            data + _getSlotOffset(groupCount, groupIndex, index));
+        Control* ctrl;
+        V* entry;
+        if (!_findIn(data, groupCount, v, v.hash(), ctrl, entry,
+                     [](size_t) { return true; })) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // The length of an image of `groupCount` groups, header included, or
+  // nullopt if that overflows a size_t, as a group count read from a damaged
+  // file can make it.
+  static std::optional<size_t> _imageSize(uint64_t groupCount) {
+    constexpr size_t GroupBytes = GroupSize * (1 + sizeof(V));
+    if (groupCount > (SIZE_MAX - sizeof(ImageHeader)) / GroupBytes) {
+      return std::nullopt;
+    }
+    return sizeof(ImageHeader) + groupCount * GroupBytes;
+  }
+
+  static ImageHeader _imageHeader(uint64_t groupCount, uint64_t count) {
+    // Bumped whenever the arrays or how hashes index them change.
+    constexpr uint32_t ImageVersion = 1;
+    return ImageHeader{{'H', 'S', 'E', 'T', 'I', 'M', 'G', '\0'},
+                       ImageVersion,
+                       GroupSize,
+                       sizeof(V),
+                       alignof(V),
+                       TagShift,
+                       RoutingShift,
+                       groupCount,
+                       count};
+  }
+
+  // How many entries `groupCount` groups hold without crossing MaxLoadFactor.
+  static size_t _capacityOf(size_t groupCount) {
+    return size_t(groupCount * GroupSize * MaxLoadFactor);
+  }
+
+  // The smallest group count that holds `count` entries without crossing
+  // MaxLoadFactor.
+  static size_t _groupsFor(size_t count) {
+    size_t groupCount =
+        std::max<size_t>(1, size_t(count / (GroupSize * MaxLoadFactor)));
+    while (count > _capacityOf(groupCount)) {
+      groupCount++;
+    }
+    return groupCount;
+  }
+
+  // The group count after growing once from `groupCount`.
+  static size_t _grownGroupCount(size_t groupCount) {
+    return std::max(groupCount + 1, size_t(groupCount * GrowthFactor + 0.5));
+  }
+
+  // The group a probe for `hash` starts at: hash bits [0, RoutingShift),
+  // shifted to the top of a 64-bit fraction and scaled onto [0, groupCount)
+  // with one multiply (Lemire's fastrange), which works for any group count.
+  //     (hash % 2^RoutingShift) * groupCount / 2^RoutingShift
+  static size_t _groupOf(size_t hash, size_t groupCount) {
+    return size_t((__uint128_t(hash << (64 - RoutingShift)) * groupCount) >>
+                  64);
+  }
+
+  // The group after `groupIndex`, wrapping around at `groupCount`.
+  static size_t _nextGroup(size_t groupIndex, size_t groupCount) {
+    return ++groupIndex == groupCount ? 0 : groupIndex;
+  }
+
+  // Allocate the arrays for `groupCount` groups, with every slot Empty, using
+  // up to `threads` threads.
+  static Buffer _allocate(ByteAllocator allocator, size_t groupCount,
+                          size_t threads = 1) {
+    // Only the control bytes need initializing; a slot is written before its
+    // control byte marks it full.
+    size_t const size = (groupCount * GroupSize) * (1 + sizeof(V));
+    /*                  [       capacity      ]   [control+value] */
+    if constexpr (RecyclingAllocator) {
+      if (std::byte* const bytes = allocator.take_recycled(size)) {
+        return Buffer{bytes, Deallocate(std::move(allocator), size)};
+      }
+    }
+    std::byte* const bytes = _allocateBytes(allocator, size);
+    Buffer data{bytes, Deallocate(std::move(allocator), size)};
+    threads = std::min(threads, groupCount / MinGroupsPerRehashThread);
+    if (threads <= 1) {
+      std::memset(data.get(), 0xFF, groupCount * GroupSize);
+      return data;
+    }
+    // Each worker takes the control bytes and the slots of an equal run of
+    // groups, so whoever later works on those groups finds their pages
+    // nearby. Slots only need their pages faulted in, which writing any byte
+    // of a page does; the kernel zero-fills the rest.
+    size_t const chunk = (groupCount + threads - 1) / threads;
+    auto touch = [&data, groupCount](size_t first, size_t last) {
+      std::memset(data.get() + first * GroupSize, 0xFF,
+                  (last - first) * GroupSize);
+      std::byte* const slots = data.get() + groupCount * GroupSize;
+      constexpr size_t PageSize = 4096;
+      for (size_t offset = first * GroupSize * sizeof(V);
+           offset < last * GroupSize * sizeof(V); offset += PageSize) {
+        slots[offset] = std::byte{0};
+      }
+    };
+    std::vector<std::thread> workers;
+    for (size_t first = chunk; first < groupCount; first += chunk) {
+      workers.emplace_back(touch, first, std::min(first + chunk, groupCount));
+    }
+    touch(0, chunk);
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+    return data;
+  }
+
+  // Copy the arrays at `data`, which has `groupCount` groups.
+  static Buffer _clone(ByteAllocator allocator, std::byte const* data,
+                       size_t groupCount) {
+    size_t const size = (groupCount * GroupSize) * (1 + sizeof(V));
+    std::byte* const bytes = _allocateBytes(allocator, size);
+    Buffer copy{bytes, Deallocate(std::move(allocator), size)};
+    if constexpr (std::is_trivially_copyable_v<V>) {
+      std::memcpy(copy.get(), data, size);
+    } else {
+      std::memcpy(copy.get(), data, groupCount * GroupSize);
+      for (size_t i = 0; i < groupCount * GroupSize; ++i) {
+        if (!bool(data[i] & std::byte(0b1000'0000))) {
+          size_t const slotOffset = groupCount * GroupSize + i * sizeof(V);
+          new (copy.get() + slotOffset)
+              V(*reinterpret_cast<V const*>(data + slotOffset));
+        }
+      }
+    }
+    return copy;
+  }
+
+  // Make room for one more entry: move an incremental migration along, and
+  // grow if the table is over its load factor.
+  void _prepareInsert() {
+    _migrateStep();
+    if (_count > _capacityOf(_groupCount)) {
+      if (_migrationGroups == 0) {
+        _rehash();
+      } else {
+        _startMigration(_grownGroupCount(_groupCount));
+      }
+    }
+  }
+
+  void _rehash() { _rehash(_grownGroupCount(_groupCount)); }
+
+  // Halve the table, as many times as it takes, if it is below
+  // _shrinkLoadFactor.
+  void _maybeShrink() {
+    auto const underloaded = [&](size_t groupCount) {
+      return groupCount > 1 &&
+             _count < size_t(groupCount * GroupSize * _shrinkLoadFactor);
+    };
+    if (!underloaded(_groupCount)) {
+      return;
+    }
+    size_t groupCount = _groupCount / 2;
+    while (underloaded(groupCount)) {
+      groupCount /= 2;
+    }
+    _rehash(groupCount);
+  }
+
+  void _rehash(size_t newGroupCount) {
+    _finishMigration();
+    if constexpr (InPlaceGrowth) {
+      if (newGroupCount > _groupCount) {
+        _growInPlace(newGroupCount);
+        return;
+      }
+    }
     size_t const prevGroupCount = _groupCount;
-    _groupCount *= GrowthFactor;
-    size_t const size =
-        _groupCount * GroupSize + _groupCount * sizeof(V) * GroupSize;
-    std::unique_ptr<std::byte[]> newData = std::make_unique<std::byte[]>(size);
-    std::memset(newData.get(), 0xFF, _groupCount * GroupSize);
+    _groupCount = newGroupCount;
+    Buffer newData = _allocate(_allocator(), _groupCount, _initThreads);
 
-    // walk through metadata 16 slots at a time
+    size_t const threads =
+        std::min(_rehashThreads, prevGroupCount / MinGroupsPerRehashThread);
+    if (threads <= 1) {
+      _moveGroups<false>(_data.get(), prevGroupCount, 0, prevGroupCount,
+                         newData);
+    } else {
+      // Hand each worker an equal run of old groups. Their entries can land
+      // anywhere, so workers claim new slots with _insertConcurrent.
+      size_t const chunk = (prevGroupCount + threads - 1) / threads;
+      std::vector<std::thread> workers;
+      for (size_t first = chunk; first < prevGroupCount; first += chunk) {
+        workers.emplace_back([&, first] {
+          _moveGroups<true>(_data.get(), prevGroupCount, first,
+                            std::min(first + chunk, prevGroupCount), newData);
+        });
+      }
+      _moveGroups<true>(_data.get(), prevGroupCount, 0, chunk, newData);
+      for (std::thread& worker : workers) {
+        worker.join();
+      }
+    }
+
+    _data = std::move(newData);
+  }
+
+  // Grow to `newGroupCount` groups inside the current array, extended with
+  // the allocator's reallocate(), so that old and new arrays are never held
+  // at the same time. Runs on the calling thread only, whatever
+  // set_rehash_threads() says.
+  void _growInPlace(size_t newGroupCount) {
+    size_t const prevGroupCount = _groupCount;
+    size_t const prevSize = (prevGroupCount * GroupSize) * (1 + sizeof(V));
+    size_t const newSize = (newGroupCount * GroupSize) * (1 + sizeof(V));
+    ByteAllocator allocator = _allocator();
+    std::byte* const data =
+        allocator.reallocate(_data.get(), prevSize, newSize);
+    _data.release();
+    _data = Buffer{data, Deallocate(std::move(allocator), newSize)};
+    _groupCount = newGroupCount;
+
+    // Slot i stays slot i for now: the slots move up past the longer control
+    // array, then each old control byte becomes Removed if it was full and
+    // Empty otherwise, dropping tombstones. Removed now means "still to be
+    // placed", and the new groups start out Empty.
+    std::memmove(data + newGroupCount * GroupSize,
+                 data + prevGroupCount * GroupSize,
+                 prevGroupCount * GroupSize * sizeof(V));
     for (size_t groupIndex = 0; groupIndex < prevGroupCount; ++groupIndex) {
+      void* group = data + (groupIndex * GroupSize);
+      __m128i groupVec = _mm_loadu_si128(reinterpret_cast<__m128i*>(group));
+      __m128i highBit = _mm_set1_epi8(uint8_t(0b1000'0000));
+      // 0xFF for each full byte, i.e. each byte whose high bit is 0
+      __m128i fullVec = _mm_cmpeq_epi8(_mm_and_si128(groupVec, highBit),
+                                       _mm_setzero_si128());
+      // full bytes become 0b1000'0000 (Removed), the rest 0b1111'1111 (Empty)
+      groupVec = _mm_or_si128(_mm_andnot_si128(fullVec, _mm_set1_epi8(-1)),
+                              highBit);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(group), groupVec);
+    }
+    std::memset(data + prevGroupCount * GroupSize, 0xFF,
+                (newGroupCount - prevGroupCount) * GroupSize);
+
+    // Place every Removed entry as an insert would, at the first free byte
+    // of its probe. Groups probed past are all full and stay so, because only
+    // placed entries are full and they never move again. If that first free
+    // group is the entry's own, it stays put; if the free byte is Removed,
+    // the two entries swap and the one swapped in is placed next.
+    for (size_t i = 0; i < prevGroupCount * GroupSize; ++i) {
+      Control* ctrl = reinterpret_cast<Control*>(data + i);
+      V* entry = reinterpret_cast<V*>(data + newGroupCount * GroupSize +
+                                      i * sizeof(V));
+      while (*ctrl == Control::Removed) {
+        size_t const hash = entry->hash();
+        Control const tag{uint8_t(hash >> TagShift)};
+        size_t groupIndex = _groupOf(hash, newGroupCount);
+        int free;
+        while ((free = _matchFree(data + groupIndex * GroupSize)) == 0) {
+          groupIndex = _nextGroup(groupIndex, newGroupCount);
+        }
+        if (groupIndex == i / GroupSize) {
+          *ctrl = tag;
+          break;
+        }
+        size_t const target =
+            groupIndex * GroupSize +
+            std::countr_zero(static_cast<unsigned int>(free));
+        Control* targetCtrl = reinterpret_cast<Control*>(data + target);
+        V* targetEntry = reinterpret_cast<V*>(
+            data + newGroupCount * GroupSize + target * sizeof(V));
+        if (*targetCtrl == Control::Empty) {
+          std::memcpy(targetEntry, entry, sizeof(V));
+          *ctrl = Control::Empty;
+        } else {
+          std::swap(*targetEntry, *entry);
+        }
+        *targetCtrl = tag;
+      }
+    }
+  }
+
+  // Start an incremental migration to `newGroupCount` groups: the current
+  // array becomes the old one and a fresh, empty one takes its place.
+  void _startMigration(size_t newGroupCount) {
+    _finishMigration();
+    Buffer newData = _allocate(_allocator(), newGroupCount, _initThreads);
+    _oldData = std::move(_data);
+    _oldGroupCount = _groupCount;
+    _migrated = 0;
+    _groupCount = newGroupCount;
+    _data = std::move(newData);
+  }
+
+  // Move the next _migrationGroups old groups into the new array.
+  void _migrateStep() {
+    if (_oldData == nullptr) {
+      return;
+    }
+    size_t const last =
+        std::min(_migrated + _migrationGroups, _oldGroupCount);
+    _moveGroups<false>(_oldData.get(), _oldGroupCount, _migrated, last, _data);
+    // Lookups keep probing the old array until the migration is done, and an
+    // entry further along may have probed through these groups, so what was
+    // moved out has to read as Removed, not Empty.
+    for (size_t groupIndex = _migrated; groupIndex < last; ++groupIndex) {
+      void* group = _oldData.get() + (groupIndex * GroupSize);
+      __m128i groupVec = _mm_loadu_si128(reinterpret_cast<__m128i*>(group));
+      __m128i highBit = _mm_set1_epi8(uint8_t(0b1000'0000));
+      // 0xFF for each full byte, i.e. each byte whose high bit is 0
+      __m128i fullVec = _mm_cmpeq_epi8(_mm_and_si128(groupVec, highBit),
+                                       _mm_setzero_si128());
+      // full bytes become Removed (0b1000'0000), the rest stay as they are
+      groupVec = _mm_or_si128(_mm_and_si128(fullVec, highBit),
+                              _mm_andnot_si128(fullVec, groupVec));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(group), groupVec);
+    }
+    _migrated = last;
+    if (_migrated == _oldGroupCount) {
+      _oldData.reset();
+      _oldGroupCount = 0;
+    }
+  }
+
+  // Move whatever an incremental migration has left in one go.
+  void _finishMigration() {
+    if (_oldData != nullptr) {
+      _moveGroups<false>(_oldData.get(), _oldGroupCount, _migrated,
+                         _oldGroupCount, _data);
+      _oldData.reset();
+      _oldGroupCount = 0;
+    }
+  }
+
+  // Move the entries of groups [first, last) of `from`, which has
+  // `fromGroupCount` groups, into `newData`, which has _groupCount groups.
+  template <bool Concurrent>
+  void _moveGroups(std::byte* from, size_t fromGroupCount, size_t first,
+                   size_t last, Buffer& newData) {
+    // walk through metadata 16 slots at a time
+    for (size_t groupIndex = first; groupIndex < last; ++groupIndex) {
       // get the 16 byte chunk to examine
-      void* group = _data.get() + (groupIndex * GroupSize);
+      void* group = from + (groupIndex * GroupSize);
       __m128i groupVec = _mm_loadu_si128(reinterpret_cast<__m128i*>(group));
       // broadcast the single-byte control sequence to a 16-byte vector
       __m128i ctrlVec = _mm_set1_epi8(uint8_t(0b1000'0000));
@@ -142,25 +1043,61 @@ struct HashSet {
         int index = std::countr_zero(static_cast<unsigned int>(matches));
         // get the slot of the associated control byte
         size_t const slotOffset =
-            _getSlotOffset(prevGroupCount, groupIndex, index);
-        V* value = reinterpret_cast<V*>(_data.get() + slotOffset);
-        _insert(std::move(*value), newData);
+            _getSlotOffset(fromGroupCount, groupIndex, index);
+        V* value = reinterpret_cast<V*>(from + slotOffset);
+        if constexpr (Concurrent) {
+          _insertConcurrent(std::move(*value), newData);
+        } else {
+          _insert(std::move(*value), newData);
+        }
 
         // adjust the bitmask by zeroing out the index we just tried
         matches &= (matches - 1);  // bit twiddling hack on trailing 0s
       }
     }
 
-    _data = std::move(newData);
   }
 
-  bool _insert(V v, std::unique_ptr<std::byte[]>& data) {
+  // _insert for when several threads fill `data` at once, during a parallel
+  // _rehash. A thread claims a slot by compare-exchanging its control byte
+  // from Empty to the tag, then writes the entry; nothing reads entries until
+  // every thread is done. Control bytes only ever go from Empty to full here,
+  // so a group whose Empty bytes were all claimed by others is full and the
+  // probe can move on.
+  void _insertConcurrent(V&& v, Buffer& data) const {
+    size_t const hash = v.hash();
+    uint8_t const tag = uint8_t(hash >> TagShift);
+    size_t groupIndex = _groupOf(hash, _groupCount);
+    while (true) {
+      std::byte* group = data.get() + (groupIndex * GroupSize);
+      // other threads may be claiming bytes of this group, so read it
+      // atomically, as two 8-byte halves
+      uint64_t const halves[2] = {
+          std::atomic_ref(*reinterpret_cast<uint64_t*>(group))
+              .load(std::memory_order_relaxed),
+          std::atomic_ref(*reinterpret_cast<uint64_t*>(group + 8))
+              .load(std::memory_order_relaxed)};
+      for (int free = _matchEmpty(halves); free != 0; free &= (free - 1)) {
+        int index = std::countr_zero(static_cast<unsigned int>(free));
+        uint8_t expected = uint8_t(Control::Empty);
+        if (std::atomic_ref(*reinterpret_cast<uint8_t*>(group + index))
+                .compare_exchange_strong(expected, tag,
+                                         std::memory_order_relaxed)) {
+          V* slot = reinterpret_cast<V*>(
+              data.get() + _getSlotOffset(_groupCount, groupIndex, index));
+          *slot = std::move(v);
+          return;
+        }
+      }
+      groupIndex = _nextGroup(groupIndex, _groupCount);
+    }
+  }
+
+  bool _insert(V v, Buffer& data) {
     size_t const hash = v.hash();
-    uint8_t const mostSignificantBits = uint8_t(hash >> 57);
+    uint8_t const mostSignificantBits = uint8_t(hash >> TagShift);
     Control const ctrl{mostSignificantBits};
-    // This works because _groupCount is a power of 2
-    //                               hash %  _groupCount
-    size_t groupIndex = hash & (_groupCount - 1);
+    size_t groupIndex = _groupOf(hash, _groupCount);
     size_t const initialGroupIndex = groupIndex;
     while (true) {
       // first, get the 16 bytes to examine (the group)
@@ -193,9 +1130,7 @@ struct HashSet {
       }
 
       // TODO: should this actually be a quadratic search?
-      // This works because _groupCount is a power of 2
-      //           (groupIndex + 1) %  _groupCount;
-      groupIndex = (groupIndex + 1) & (_groupCount - 1);
+      groupIndex = _nextGroup(groupIndex, _groupCount);
       if (groupIndex == initialGroupIndex) {
         return false;
       }
@@ -203,17 +1138,40 @@ struct HashSet {
     return false;
   }
 
-  bool _find(V const& v, Control*& ctrlOut, V*& entryOut) const {
-    size_t const hash = v.hash();
-    uint8_t const mostSignificantBits = uint8_t(hash >> 57);
+  bool _find(V const& v, size_t hash, Control*& ctrlOut,
+             V*& entryOut) const {
+    return _find(v, hash, ctrlOut, entryOut, [](size_t) { return true; });
+  }
+
+  // _find, calling `visit(groupIndex)` before each group it examines. If
+  // `visit` returns false, the probe is abandoned and reports not found.
+  template <typename Visit>
+  bool _find(V const& v, size_t hash, Control*& ctrlOut, V*& entryOut,
+             Visit&& visit) const {
+    // While an incremental migration is running, entries that haven't moved
+    // yet are still in the old array.
+    return _findIn(_data.get(), _groupCount, v, hash, ctrlOut, entryOut,
+                   visit) ||
+           (_oldData != nullptr &&
+            _findIn(_oldData.get(), _oldGroupCount, v, hash, ctrlOut,
+                    entryOut, visit));
+  }
+
+  // _find in the arrays at `data`, which has `groupCount` groups.
+  template <typename Visit>
+  static bool _findIn(std::byte* data, size_t groupCount, V const& v,
+                      size_t hash, Control*& ctrlOut, V*& entryOut,
+                      Visit&& visit) {
+    uint8_t const mostSignificantBits = uint8_t(hash >> TagShift);
     Control const ctrl{mostSignificantBits};
-    // This works because _groupCount is a power of 2
-    //                               hash %  _groupCount
-    size_t groupIndex = hash & (_groupCount - 1);
+    size_t groupIndex = _groupOf(hash, groupCount);
     size_t const initialGroupIndex = groupIndex;
     while (true) {
+      if (!visit(groupIndex)) {
+        return false;
+      }
       // first, get the 16 bytes to examine (the group)
-      void* group = _data.get() + (groupIndex * GroupSize);
+      void* group = data + (groupIndex * GroupSize);
       __m128i groupVec = _mm_loadu_si128(reinterpret_cast<__m128i*>(group));
       // broadcast the single-byte control sequence to a 16-byte vector
       __m128i ctrlVec = _mm_set1_epi8(uint8_t(ctrl));
@@ -228,11 +1186,10 @@ struct HashSet {
         // Trailing Zero Count - find the first set bit
         int index = std::countr_zero(static_cast<unsigned int>(matches));
         // try index's associated value for equality
-        size_t const slotOffset =
-            _getSlotOffset(_groupCount, groupIndex, index);
-        V* candidate = reinterpret_cast<V*>(_data.get() + slotOffset);
+        size_t const slotOffset = _getSlotOffset(groupCount, groupIndex, index);
+        V* candidate = reinterpret_cast<V*>(data + slotOffset);
         // this comparison is very likely to succeed
-        if (*candidate == v) {
+        if (_equal(*candidate, v)) {
           ctrlOut = reinterpret_cast<Control*>(
               reinterpret_cast<std::byte*>(group) + index);
           entryOut = candidate;
@@ -259,9 +1216,7 @@ struct HashSet {
       }
 
       // TODO: should this actually be a quadratic search?
-      // This works because _groupCount is a power of 2
-      //           (groupIndex + 1) %  _groupCount;
-      groupIndex = (groupIndex + 1) & (_groupCount - 1);
+      groupIndex = _nextGroup(groupIndex, groupCount);
       if (groupIndex == initialGroupIndex) {
         return false;
       }
@@ -269,12 +1224,274 @@ struct HashSet {
     return false;
   }
 
+  template <typename Fn>
+  bool _upsert(V&& v, size_t hash, Fn& fn) {
+    _prepareInsert();
+    Control* ctrl;
+    V* entry;
+    if (_findOrPrepareInsert(v, hash, ctrl, entry)) {
+      fn(*entry);
+      return false;
+    }
+    Control* oldCtrl;
+    V* oldEntry;
+    if (_oldData != nullptr &&
+        _findIn(_oldData.get(), _oldGroupCount, v, hash, oldCtrl, oldEntry,
+                [](size_t) { return true; })) {
+      fn(*oldEntry);
+      return false;
+    }
+    assert(ctrl != nullptr);
+    _insertAt(ctrl, entry, std::move(v), hash);
+    return true;
+  }
+
+  // Fill the free slot behind `ctrl` with `v`.
+  void _insertAt(Control* ctrl, V* entry, V&& v, size_t hash) {
+    _fillSlot(ctrl, entry, std::move(v), hash);
+    _count++;
+  }
+
+  // _insertAt without the bookkeeping, for callers that keep their own count.
+  static void _fillSlot(Control* ctrl, V* entry, V&& v, size_t hash) {
+    *entry = std::move(v);
+    _storeControl(ctrl, Control{uint8_t(hash >> TagShift)});
+  }
+
+  // Write a control byte of a live table. The store is atomic, so that
+  // SingleWriterHashSet's readers can load control bytes while its writer
+  // changes them; relaxed, it's an ordinary byte store.
+  static void _storeControl(Control* ctrl, Control value) {
+    std::atomic_ref(*ctrl).store(value, std::memory_order_relaxed);
+  }
+
+  // Compare two keys, with a single SIMD compare over the key bytes for
+  // bitwise comparable keys.
+  static bool _equal(V const& a, V const& b) {
+    if constexpr (!BitwiseCompare) {
+      return a == b;
+    } else if constexpr (sizeof(V) == 8) {
+      uint64_t lhs, rhs;
+      std::memcpy(&lhs, &a, sizeof(V));
+      std::memcpy(&rhs, &b, sizeof(V));
+      return lhs == rhs;
+    } else {
+      // compare 16 bytes at a time; every byte must match
+      __m128i cmpVec = _mm_cmpeq_epi8(
+          _mm_loadu_si128(reinterpret_cast<__m128i const*>(&a)),
+          _mm_loadu_si128(reinterpret_cast<__m128i const*>(&b)));
+      if constexpr (sizeof(V) == 32) {
+        cmpVec = _mm_and_si128(
+            cmpVec,
+            _mm_cmpeq_epi8(
+                _mm_loadu_si128(reinterpret_cast<__m128i const*>(&a) + 1),
+                _mm_loadu_si128(reinterpret_cast<__m128i const*>(&b) + 1)));
+      }
+      return _mm_movemask_epi8(cmpVec) == 0xFFFF;
+    }
+  }
+
+  // Mark the slot behind `ctrl` free and destroy its entry.
+  void _eraseAt(Control* ctrl, V* entry) {
+    _clearSlot(ctrl, entry);
+    _count--;
+  }
+
+  // _eraseAt without the bookkeeping, for callers that keep their own count.
+  void _clearSlot(Control* ctrl, V* entry) {
+    // A group only loses its last Empty byte by filling up, and probes only
+    // move past a group that has no Empty byte. So if this group still has an
+    // Empty byte, no probe has ever continued past it and nothing depends on
+    // this slot reading as "was full". It can go straight back to Empty rather
+    // than leaving a tombstone behind.
+    // (The arrays are GroupSize aligned, so the group starts at the control
+    // byte's address rounded down.)
+    void const* group = reinterpret_cast<void const*>(
+        reinterpret_cast<uintptr_t>(ctrl) & ~uintptr_t(GroupSize - 1));
+    _storeControl(ctrl,
+                  _matchEmpty(group) != 0 ? Control::Empty : Control::Removed);
+
+    // We don't actually have to do anything to the erased entry if it's
+    // trivially destructible. Otherwise, run the destructor.
+    if constexpr (!std::is_trivially_destructible_v<V>) {
+      entry->~V();
+    }
+
+#if DEBUG
+    // Zero memory out in debug just for debugging help.
+    memset(entry, 0x00, sizeof(V));
+#endif
+  }
+
+  // Get a bitmask of the Empty control bytes in the group at `group`.
+  static int _matchEmpty(void const* group) {
+    return _matchTag(group, Control::Empty);
+  }
+
+  // Pull the control bytes and the first slots of the group `hash` starts
+  // probing at into cache.
+  void _prefetch(size_t hash) const {
+    size_t const groupIndex = _groupOf(hash, _groupCount);
+    std::byte const* data = _data.get();
+    _mm_prefetch(reinterpret_cast<char const*>(data + groupIndex * GroupSize),
+                 _MM_HINT_T0);
+    _mm_prefetch(reinterpret_cast<char const*>(
+                     data + _getSlotOffset(_groupCount, groupIndex, 0)),
+                 _MM_HINT_T0);
+  }
+
+  // Run `op(value, hash)` over `values` in order, hashing and prefetching
+  // PrefetchDistance values ahead of the one being processed. `op` may mutate
+  // the table; a stale prefetch only costs a wasted load.
+  template <typename Op>
+  void _pipelined(std::span<V const> values, Op&& op) {
+    size_t hashes[PrefetchDistance];
+    size_t const n = values.size();
+    for (size_t i = 0; i < n && i < PrefetchDistance; ++i) {
+      hashes[i] = values[i].hash();
+      _prefetch(hashes[i]);
+    }
+    for (size_t i = 0; i < n; ++i) {
+      size_t const hash = hashes[i % PrefetchDistance];
+      if (i + PrefetchDistance < n) {
+        size_t const ahead = values[i + PrefetchDistance].hash();
+        hashes[i % PrefetchDistance] = ahead;
+        _prefetch(ahead);
+      }
+      op(values[i], hash);
+    }
+  }
+
+  // Like _find, but if `v` is missing, point the outputs at the first free
+  // slot along its probe sequence instead, so that an insert can follow
+  // without probing again. If there is no free slot, they are nullptr.
+  bool _findOrPrepareInsert(V const& v, size_t hash, Control*& ctrlOut,
+                            V*& entryOut) const {
+    return _findOrPrepareInsert(v, hash, ctrlOut, entryOut,
+                                [](size_t) { return true; });
+  }
+
+  // _findOrPrepareInsert with a visitor, as for _find. An abandoned probe
+  // reports not found with null outputs.
+  template <typename Visit>
+  bool _findOrPrepareInsert(V const& v, size_t hash, Control*& ctrlOut,
+                            V*& entryOut, Visit&& visit) const {
+    Control const ctrl{uint8_t(hash >> TagShift)};
+    size_t groupIndex = _groupOf(hash, _groupCount);
+    size_t const initialGroupIndex = groupIndex;
+    Control* freeCtrl = nullptr;
+    V* freeEntry = nullptr;
+    do {
+      if (!visit(groupIndex)) {
+        ctrlOut = nullptr;
+        entryOut = nullptr;
+        return false;
+      }
+      std::byte* group = _data.get() + (groupIndex * GroupSize);
+      for (int matches = _matchTag(group, ctrl); matches != 0;
+           matches &= (matches - 1)) {
+        int index = std::countr_zero(static_cast<unsigned int>(matches));
+        V* candidate = reinterpret_cast<V*>(
+            _data.get() + _getSlotOffset(_groupCount, groupIndex, index));
+        if (_equal(*candidate, v)) {
+          ctrlOut = reinterpret_cast<Control*>(group + index);
+          entryOut = candidate;
+          return true;
+        }
+      }
+      // Remember the first Empty or Removed slot we pass; that is where _insert
+      // would have put `v`.
+      int const free = _matchFree(group);
+      if (freeCtrl == nullptr && free != 0) {
+        int index = std::countr_zero(static_cast<unsigned int>(free));
+        freeCtrl = reinterpret_cast<Control*>(group + index);
+        freeEntry = reinterpret_cast<V*>(
+            _data.get() + _getSlotOffset(_groupCount, groupIndex, index));
+      }
+      // An Empty byte ends the probe, as in _find.
+      if (_matchEmpty(group) != 0) {
+        break;
+      }
+      groupIndex = _nextGroup(groupIndex, _groupCount);
+    } while (groupIndex != initialGroupIndex);
+    ctrlOut = freeCtrl;
+    entryOut = freeEntry;
+    return false;
+  }
+
+  // Get a bitmask of the control bytes in the group at `group` equal to `ctrl`.
+  static int _matchTag(void const* group, Control ctrl) {
+    __m128i groupVec =
+        _mm_loadu_si128(reinterpret_cast<__m128i const*>(group));
+    __m128i ctrlVec = _mm_set1_epi8(uint8_t(ctrl));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(groupVec, ctrlVec));
+  }
+
+  // Get a bitmask of the Empty or Removed control bytes in the group at
+  // `group`, i.e. those with the high bit set.
+  static int _matchFree(void const* group) {
+    // movemask gathers exactly the high bit of each byte
+    return _mm_movemask_epi8(
+        _mm_loadu_si128(reinterpret_cast<__m128i const*>(group)));
+  }
+
+  // How many threads a parallel scan asking for `threads` gets: at least
+  // MinGroupsPerRehashThread groups each, and at least one.
+  size_t _scanThreads(size_t threads) const {
+    return std::max<size_t>(
+        1, std::min(threads, _groupCount / MinGroupsPerRehashThread));
+  }
+
+  // Run `work(worker, data, groupCount, first, last)` from _scanThreads
+  // threads, the calling one included, handing worker i the i-th of equal
+  // runs of groups [first, last) of each array.
+  template <typename Work>
+  void _parallelScan(size_t threads, Work const& work) const {
+    threads = _scanThreads(threads);
+    auto run = [&](size_t worker) {
+      auto share = [&](std::byte const* data, size_t groupCount) {
+        size_t const chunk = (groupCount + threads - 1) / threads;
+        size_t const first = std::min(worker * chunk, groupCount);
+        work(worker, data, groupCount, first,
+             std::min(first + chunk, groupCount));
+      };
+      share(_data.get(), _groupCount);
+      if (_oldData != nullptr) {
+        share(_oldData.get(), _oldGroupCount);
+      }
+    };
+    std::vector<std::thread> workers;
+    for (size_t worker = 1; worker < threads; ++worker) {
+      workers.emplace_back(run, worker);
+    }
+    run(0);
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+  }
+
+  // for_each over groups [first, last) of the arrays at `data`, which has
+  // `groupCount` groups.
+  template <typename Fn>
+  void _forEachIn(std::byte const* data, size_t groupCount, size_t first,
+                  size_t last, Fn& fn) const {
+    for (size_t groupIndex = first; groupIndex < last; ++groupIndex) {
+      // full slots are the ones whose control byte has the high bit clear
+      int matches = ~_matchFree(data + groupIndex * GroupSize) & 0xFFFF;
+      for (; matches != 0; matches &= (matches - 1)) {
+        int index = std::countr_zero(static_cast<unsigned int>(matches));
+        fn(*reinterpret_cast<V const*>(
+            data + _getSlotOffset(groupCount, groupIndex, index)));
+      }
+    }
+  }
+
   // Get the byte offset in the data array.
   //   groupCount:    how many groups are in the data
   //   groupIndex:    which group are we interested in
   //   entryIndex:    which entry in the group are we interested in
-  size_t _getSlotOffset(size_t groupCount, size_t groupIndex,
-                        size_t entryIndex) const {
+  static size_t _getSlotOffset(size_t groupCount, size_t groupIndex,
+                               size_t entryIndex) {
     // Form with 1 fewer multiplication, addition
     return GroupSize * (groupCount + groupIndex * sizeof(V)) +
            sizeof(V) * entryIndex;
@@ -284,3 +1501,10 @@ struct HashSet {
     //   sizeof(V) * entryIndex;              // relevant entry in slot group
   }
 };
+
+namespace pmr {
+// A HashSet that takes its memory from a std::pmr::memory_resource.
+template <typename V, double GrowthFactor = 2.0>
+using HashSet =
+    ::HashSet<V, GrowthFactor, std::pmr::polymorphic_allocator<std::byte>>;
+}  // namespace pmr
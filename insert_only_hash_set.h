@@ -0,0 +1,286 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <type_traits>
+
+#include "hash_set.h"
+
+// A lock-free set for concurrent insert and lookup, with no erase.
+//
+// An insert claims a slot by compare-exchanging its control byte from Empty
+// to Busy, writes the entry, then publishes its tag with a release store.
+// Only the first Empty byte of a group is ever claimed, and both inserts and
+// lookups wait out Busy bytes in the groups they examine, so two threads
+// inserting the same key always meet in the same group and one of them sees
+// the other's entry.
+//
+// Growth stops the world cooperatively: the inserter that crosses the load
+// factor announces a new table, waits for inserts already in flight to
+// finish, and every inserter that arrives meanwhile helps move groups across
+// instead of waiting idle. Lookups carry on in the old table, which nothing
+// writes to any more. Old tables are kept until the set is destroyed.
+template <typename V>
+struct InsertOnlyHashSet {
+  using Table = HashSet<V>;
+  // How many old groups a thread claims at a time while migrating.
+  static constexpr size_t GroupsPerMigrationChunk = 256;
+
+  static_assert(std::is_trivially_copyable_v<V>,
+                "migration copies entries while readers may be reading them");
+
+  InsertOnlyHashSet(size_t initialCapacity = 4)
+      : _table(new Generation(initialCapacity, nullptr)),
+        _next(nullptr),
+        _inFlight(0) {}
+
+  ~InsertOnlyHashSet() {
+    Generation* generation = _table.load();
+    while (generation != nullptr) {
+      delete std::exchange(generation, generation->previous);
+    }
+  }
+
+  // Returns false if an equal entry is already present.
+  bool insert(V const& v) {
+    size_t const hash = v.hash();
+    while (true) {
+      if (_next.load() != nullptr) {
+        _helpMigrate();
+        continue;
+      }
+      _inFlight.fetch_add(1);
+      // A migration announced after our check above waits for us, but one
+      // announced before our increment may not have seen it.
+      if (_next.load() != nullptr) {
+        _inFlight.fetch_sub(1);
+        continue;
+      }
+      Generation* generation = _table.load();
+      InsertResult const result = _tryInsert(*generation, v, hash);
+      bool const overloaded =
+          result == InsertResult::Inserted &&
+          generation->count.fetch_add(1, std::memory_order_relaxed) >
+              Table::_capacityOf(generation->set._groupCount);
+      _inFlight.fetch_sub(1);
+      if (result == InsertResult::Full || overloaded) {
+        _startMigration(generation);
+      }
+      if (result != InsertResult::Full) {
+        return result == InsertResult::Inserted;
+      }
+    }
+  }
+
+  bool contains(V const& v) const {
+    Generation const* generation = _table.load(std::memory_order_acquire);
+    size_t const hash = v.hash();
+    Control const tag{uint8_t(hash >> Table::TagShift)};
+    std::byte* data = generation->set._data.get();
+    size_t const groupCount = generation->set._groupCount;
+    size_t groupIndex = Table::_groupOf(hash, groupCount);
+    size_t const initialGroupIndex = groupIndex;
+    do {
+      uint64_t group[2];
+      _loadGroup(data + groupIndex * Table::GroupSize, group);
+      for (int matches = Table::_matchTag(group, tag); matches != 0;
+           matches &= (matches - 1)) {
+        int index = std::countr_zero(static_cast<unsigned int>(matches));
+        if (Table::_equal(*_published(generation->set, groupIndex, index),
+                          v)) {
+          return true;
+        }
+      }
+      if (Table::_matchEmpty(group) != 0) {
+        return false;
+      }
+      groupIndex = Table::_nextGroup(groupIndex, groupCount);
+    } while (groupIndex != initialGroupIndex);
+    return false;
+  }
+
+  // The number of entries. Only exact while no insert is running.
+  size_t size() const {
+    return _table.load()->count.load(std::memory_order_relaxed);
+  }
+
+ private:
+  // One table, plus what migrating into it from the previous one needs.
+  struct Generation {
+    Generation(size_t capacity, Generation* previous)
+        : set(capacity),
+          count(previous == nullptr ? 0 : previous->count.load()),
+          previous(previous),
+          drained(false),
+          nextChunk(0),
+          doneChunks(0) {}
+
+    Table set;
+    std::atomic<size_t> count;
+    Generation* previous;
+    // Set once no insert is in flight in `previous`, so that migrating may
+    // start.
+    std::atomic<bool> drained;
+    std::atomic<size_t> nextChunk;
+    std::atomic<size_t> doneChunks;
+  };
+
+  enum class InsertResult { Present, Inserted, Full };
+
+  std::atomic<Generation*> _table;
+  // The table being migrated into, or nullptr.
+  std::atomic<Generation*> _next;
+  // Inserts running against _table.
+  std::atomic<size_t> _inFlight;
+
+  static V* _slot(Table const& set, size_t groupIndex, int index) {
+    return reinterpret_cast<V*>(
+        set._data.get() +
+        set._getSlotOffset(set._groupCount, groupIndex, index));
+  }
+
+  // The slot behind a control byte seen full in a group loaded with
+  // _loadGroup. The byte is acquired again on its own: the language only
+  // orders the entry write before a load of the same size as the release
+  // store that published it.
+  static V const* _published(Table const& set, size_t groupIndex, int index) {
+    std::atomic_ref(
+        *reinterpret_cast<uint8_t*>(set._data.get() +
+                                    groupIndex * Table::GroupSize + index))
+        .load(std::memory_order_acquire);
+    return _slot(set, groupIndex, index);
+  }
+
+  // Read the 16 control bytes at `group`, which other threads may be
+  // claiming and publishing, as two atomic 8-byte halves. Waits while any of
+  // them is Busy.
+  static void _loadGroup(std::byte* group, uint64_t (&out)[2]) {
+    while (true) {
+      out[0] = std::atomic_ref(*reinterpret_cast<uint64_t*>(group))
+                   .load(std::memory_order_acquire);
+      out[1] = std::atomic_ref(*reinterpret_cast<uint64_t*>(group + 8))
+                   .load(std::memory_order_acquire);
+      if (Table::_matchTag(out, Control::Busy) == 0) {
+        return;
+      }
+      _mm_pause();
+    }
+  }
+
+  InsertResult _tryInsert(Generation& generation, V const& v, size_t hash) {
+    uint8_t const tag = uint8_t(hash >> Table::TagShift);
+    std::byte* data = generation.set._data.get();
+    size_t const groupCount = generation.set._groupCount;
+    size_t groupIndex = Table::_groupOf(hash, groupCount);
+    size_t const initialGroupIndex = groupIndex;
+    do {
+      std::byte* ctrl = data + groupIndex * Table::GroupSize;
+      while (true) {
+        uint64_t group[2];
+        _loadGroup(ctrl, group);
+        for (int matches = Table::_matchTag(group, Control{tag});
+             matches != 0; matches &= (matches - 1)) {
+          int index = std::countr_zero(static_cast<unsigned int>(matches));
+          if (Table::_equal(*_published(generation.set, groupIndex, index),
+                            v)) {
+            return InsertResult::Present;
+          }
+        }
+        int const empty = Table::_matchEmpty(group);
+        if (empty == 0) {
+          break;
+        }
+        int index = std::countr_zero(static_cast<unsigned int>(empty));
+        std::atomic_ref<uint8_t> slotCtrl{
+            *reinterpret_cast<uint8_t*>(ctrl + index)};
+        uint8_t expected = uint8_t(Control::Empty);
+        if (slotCtrl.compare_exchange_strong(expected, uint8_t(Control::Busy),
+                                             std::memory_order_acquire)) {
+          *_slot(generation.set, groupIndex, index) = v;
+          slotCtrl.store(tag, std::memory_order_release);
+          return InsertResult::Inserted;
+        }
+        // Someone else claimed the first Empty byte; look at the group again,
+        // it may be our key.
+      }
+      groupIndex = Table::_nextGroup(groupIndex, groupCount);
+    } while (groupIndex != initialGroupIndex);
+    return InsertResult::Full;
+  }
+
+  // What _next holds from when a thread claims a migration until it has
+  // allocated the new table. Never dereferenced.
+  static Generation* _claimed() {
+    static char marker;
+    return reinterpret_cast<Generation*>(&marker);
+  }
+
+  // Announce a migration out of `from`, unless one already happened, wait
+  // for inserts in flight to finish, then help move groups.
+  void _startMigration(Generation* from) {
+    if (_table.load() != from) {
+      return;
+    }
+    // Claim the migration before allocating its table: inserters may read a
+    // table from _next as soon as it's there, so one is only put there once
+    // it's sure to be used, and is never freed before the set.
+    Generation* expected = nullptr;
+    if (!_next.compare_exchange_strong(expected, _claimed())) {
+      return;
+    }
+    // No migration can finish while we hold _next, so _table stays put.
+    if (_table.load() != from) {
+      // The migration out of `from` finished before our claim; withdraw it.
+      _next.store(nullptr);
+      return;
+    }
+    Generation* to;
+    try {
+      to = new Generation(Table::_capacityOf(2 * from->set._groupCount), from);
+    } catch (...) {
+      _next.store(nullptr);
+      throw;
+    }
+    _next.store(to);
+    while (_inFlight.load() != 0) {
+      std::this_thread::yield();
+    }
+    to->count.store(from->count.load());
+    to->drained.store(true);
+    _helpMigrate();
+  }
+
+  // Move chunks of groups into the announced table until none are left, and
+  // publish it if ours was the last.
+  void _helpMigrate() {
+    Generation* to = _next.load();
+    if (to == nullptr) {
+      return;
+    }
+    if (to == _claimed() || !to->drained.load()) {
+      std::this_thread::yield();
+      return;
+    }
+    Generation* from = to->previous;
+    size_t const fromGroupCount = from->set._groupCount;
+    size_t const chunkCount =
+        (fromGroupCount + GroupsPerMigrationChunk - 1) /
+        GroupsPerMigrationChunk;
+    while (true) {
+      size_t const chunk = to->nextChunk.fetch_add(1);
+      if (chunk >= chunkCount) {
+        return;
+      }
+      size_t const first = chunk * GroupsPerMigrationChunk;
+      to->set.template _moveGroups<true>(
+          from->set._data.get(), fromGroupCount, first,
+          std::min(first + GroupsPerMigrationChunk, fromGroupCount),
+          to->set._data);
+      if (to->doneChunks.fetch_add(1) + 1 == chunkCount) {
+        _table.store(to);
+        _next.store(nullptr);
+        return;
+      }
+    }
+  }
+};
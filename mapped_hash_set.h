@@ -0,0 +1,101 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <optional>
+#include <utility>
+
+#include "hash_set.h"
+
+// A read-only view of a HashSet::save() image, mapped straight from the file.
+// Lookups run on the mapped control bytes and slots with HashSet's own probe,
+// so opening costs no reads beyond the header and a few sampled lookups, and
+// every process mapping the same image shares its pages through the page
+// cache instead of holding a copy.
+template <typename V>
+struct MappedHashSet {
+  using Table = HashSet<V>;
+
+  // Map the image at `path`. Returns nullopt if it can't be mapped or isn't an
+  // image for this layout and hash function, as HashSet::load() would.
+  static std::optional<MappedHashSet> open(char const* path) {
+    int const fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+      return std::nullopt;
+    }
+    struct stat status;
+    void* mapping = MAP_FAILED;
+    if (::fstat(fd, &status) == 0 &&
+        size_t(status.st_size) >= sizeof(typename Table::ImageHeader)) {
+      mapping = ::mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    // the mapping keeps the file alive
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+      return std::nullopt;
+    }
+    MappedHashSet set{mapping, size_t(status.st_size)};
+    auto const& header =
+        *reinterpret_cast<typename Table::ImageHeader const*>(mapping);
+    if (!Table::_validHeader(header) ||
+        Table::_imageSize(header.groupCount) != set._length) {
+      return std::nullopt;
+    }
+    set._data = static_cast<std::byte*>(mapping) + sizeof(header);
+    set._groupCount = header.groupCount;
+    set._count = header.count;
+    if (!Table::_findsSample(set._data, set._groupCount)) {
+      return std::nullopt;
+    }
+    return set;
+  }
+
+  MappedHashSet(MappedHashSet&& other)
+      : _mapping(std::exchange(other._mapping, nullptr)),
+        _length(other._length),
+        _data(other._data),
+        _groupCount(other._groupCount),
+        _count(other._count) {}
+
+  MappedHashSet& operator=(MappedHashSet&& other) {
+    std::swap(_mapping, other._mapping);
+    std::swap(_length, other._length);
+    std::swap(_data, other._data);
+    std::swap(_groupCount, other._groupCount);
+    std::swap(_count, other._count);
+    return *this;
+  }
+
+  ~MappedHashSet() {
+    if (_mapping != nullptr) {
+      ::munmap(_mapping, _length);
+    }
+  }
+
+  bool contains(V const& v) const {
+    Control* ctrl;
+    V* entry;
+    return Table::_findIn(_data, _groupCount, v, v.hash(), ctrl, entry,
+                          [](size_t) { return true; });
+  }
+
+  size_t size() const { return _count; }
+
+ private:
+  MappedHashSet(void* mapping, size_t length)
+      : _mapping(mapping),
+        _length(length),
+        _data(nullptr),
+        _groupCount(0),
+        _count(0) {}
+
+  void* _mapping;
+  size_t _length;
+  // The arrays, right after the header.
+  std::byte* _data;
+  size_t _groupCount;
+  size_t _count;
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <cstddef>
+#include <new>
+
+// Gives every allocation an anonymous mapping of its own, which reallocate()
+// extends with mremap: the kernel moves page table entries instead of copying
+// pages, so growing never holds two copies. A HashSet with this allocator
+// grows inside its array (see HashSet::_growInPlace) rather than rehashing
+// into a second one.
+template <typename T>
+struct MremapAllocator {
+  using value_type = T;
+
+  MremapAllocator() = default;
+  template <typename U>
+  MremapAllocator(MremapAllocator<U> const&) {}
+
+  T* allocate(size_t count) {
+    void* data = ::mmap(nullptr, count * sizeof(T), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T*>(data);
+  }
+
+  void deallocate(T* data, size_t count) {
+    ::munmap(data, count * sizeof(T));
+  }
+
+  // Grow or shrink the allocation at `data` from `count` to `newCount`
+  // elements, keeping its contents; it may move. Throws std::bad_alloc, and
+  // leaves `data` as it was, if it can't.
+  T* reallocate(T* data, size_t count, size_t newCount) {
+    void* moved = ::mremap(data, count * sizeof(T), newCount * sizeof(T),
+                           MREMAP_MAYMOVE);
+    if (moved == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T*>(moved);
+  }
+
+  template <typename U>
+  bool operator==(MremapAllocator<U> const&) const {
+    return true;
+  }
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "hash_set.h"
+
+// A set of large entries that keeps them out of the table. Entries live in a
+// chunked arena and never move, and the flat HashSet only holds a pointer to
+// each plus its full hash: 16 bytes a slot, whatever sizeof(V). Probes compare
+// hashes before touching an entry, and growth moves 16 bytes per entry and
+// never rehashes one.
+//
+// This pays an extra cache miss per successful lookup to make probing and
+// growth independent of sizeof(V), so it only wins for large entries.
+template <typename V>
+struct OutOfLineHashSet {
+  // How many entries each arena chunk holds.
+  static constexpr size_t ChunkSize = 256;
+
+  OutOfLineHashSet(size_t initialCapacity = 4) : _set(initialCapacity) {}
+
+  OutOfLineHashSet(OutOfLineHashSet const&) = delete;
+  OutOfLineHashSet& operator=(OutOfLineHashSet const&) = delete;
+
+  ~OutOfLineHashSet() {
+    _set.for_each([](Handle const& handle) { handle.value->~V(); });
+  }
+
+  // Returns false if an equal entry is already present.
+  bool insert(V v) {
+    size_t const hash = v.hash();
+    // Grow first, so that nothing is left to clean up if growing throws, then
+    // find the key or its free slot in one probe. The entry is only built in
+    // the arena once the key is known to be new.
+    _set._prepareInsert();
+    Control* ctrl;
+    Handle* handle;
+    if (_set._findOrPrepareInsert(Handle{&v, hash}, hash, ctrl, handle)) {
+      return false;
+    }
+    assert(ctrl != nullptr);
+    void* slot = _allocate();
+    V* value;
+    try {
+      value = new (slot) V(std::move(v));
+    } catch (...) {
+      _release(static_cast<V*>(slot));
+      throw;
+    }
+    _set._insertAt(ctrl, handle, Handle{value, hash}, hash);
+    return true;
+  }
+
+  bool contains(V const& v) const { return find(v) != nullptr; }
+
+  // The entry equal to `v`, or nullptr. Entries keep their address until
+  // erased.
+  V const* find(V const& v) const {
+    Handle const* handle = _set.find(Handle{const_cast<V*>(&v), v.hash()});
+    return handle != nullptr ? handle->value : nullptr;
+  }
+
+  bool erase(V const& v) {
+    size_t const hash = v.hash();
+    Control* ctrl;
+    Handle* handle;
+    if (!_set._find(Handle{const_cast<V*>(&v), hash}, hash, ctrl, handle)) {
+      return false;
+    }
+    V* value = handle->value;
+    _set._eraseAt(ctrl, handle);
+    value->~V();
+    _release(value);
+    return true;
+  }
+
+  size_t size() const { return _set.size(); }
+
+ private:
+  // What the table stores for an entry.
+  struct Handle {
+    V* value;
+    size_t fullHash;
+
+    // Most candidates are told apart by their hash without a cache miss on
+    // the entry.
+    bool operator==(Handle const& other) const {
+      return fullHash == other.fullHash && *value == *other.value;
+    }
+    size_t hash() const noexcept { return fullHash; }
+  };
+
+  // An arena slot: an entry, or a link in the free list once it's erased.
+  union Slot {
+    Slot* next;
+    alignas(V) std::byte storage[sizeof(V)];
+  };
+
+  HashSet<Handle> _set;
+  std::vector<std::unique_ptr<Slot[]>> _chunks;
+  // Slots used in the last chunk.
+  size_t _used = ChunkSize;
+  Slot* _free = nullptr;
+
+  void* _allocate() {
+    if (_free != nullptr) {
+      return std::exchange(_free, _free->next);
+    }
+    if (_used == ChunkSize) {
+      _chunks.push_back(std::make_unique_for_overwrite<Slot[]>(ChunkSize));
+      _used = 0;
+    }
+    return &_chunks.back()[_used++];
+  }
+
+  void _release(V* value) {
+    Slot* slot = reinterpret_cast<Slot*>(value);
+    slot->next = _free;
+    _free = slot;
+  }
+};
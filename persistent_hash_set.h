@@ -0,0 +1,322 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <new>
+#include <optional>
+#include <string>
+#include <type_traits>
+
+#include "hash_set.h"
+
+// Allocates each array in a file of its own, `<path>.<generation>`, mapped
+// MAP_SHARED, with room for a HashSet::ImageHeader in front so that the file
+// is a save() image once a header is written. Freeing an array unmaps it but
+// leaves the file; PersistentHashSet decides when a generation is obsolete.
+struct MappedFileAllocator {
+  using value_type = std::byte;
+  template <typename U>
+  struct rebind {
+    static_assert(std::is_same_v<U, std::byte>, "tables allocate bytes");
+    using other = MappedFileAllocator;
+  };
+  // sizeof(HashSet::ImageHeader), which keeps the arrays 16-byte aligned.
+  static constexpr size_t HeaderSize = 48;
+
+  explicit MappedFileAllocator(std::string path, uint64_t firstGeneration = 0)
+      : _state(std::make_shared<State>(std::move(path), firstGeneration)) {}
+
+  std::byte* allocate(size_t size) {
+    uint64_t const generation = _state->nextGeneration++;
+    std::string const path = generation_path(_state->path, generation);
+    int const fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      throw std::bad_alloc();
+    }
+    std::byte* data = map(fd, HeaderSize + size, generation);
+    ::close(fd);
+    if (data == nullptr) {
+      std::filesystem::remove(path);
+      throw std::bad_alloc();
+    }
+    return data;
+  }
+
+  void deallocate(std::byte* data, size_t size) {
+    ::munmap(data - HeaderSize, HeaderSize + size);
+    _state->generations.erase(data);
+  }
+
+  // Map `length` bytes of the file open at `fd`, growing it if needed, and
+  // return where the arrays start, or nullptr.
+  std::byte* map(int fd, size_t length, uint64_t generation) {
+    struct stat status;
+    if (::fstat(fd, &status) != 0 ||
+        (size_t(status.st_size) < length && ::ftruncate(fd, length) != 0)) {
+      return nullptr;
+    }
+    void* mapping =
+        ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+      return nullptr;
+    }
+    std::byte* data = static_cast<std::byte*>(mapping) + HeaderSize;
+    _state->generations[data] = generation;
+    return data;
+  }
+
+  // The generation an array from this allocator lives in.
+  uint64_t generation_of(std::byte const* data) const {
+    return _state->generations.at(const_cast<std::byte*>(data));
+  }
+
+  std::string const& path() const { return _state->path; }
+
+  static std::string generation_path(std::string const& path,
+                                     uint64_t generation) {
+    return path + "." + std::to_string(generation);
+  }
+
+  bool operator==(MappedFileAllocator const& other) const {
+    return _state == other._state;
+  }
+
+ private:
+  struct State {
+    State(std::string path, uint64_t nextGeneration)
+        : path(std::move(path)), nextGeneration(nextGeneration) {}
+
+    std::string path;
+    uint64_t nextGeneration;
+    // The generation each live array was mapped from.
+    std::map<std::byte*, uint64_t> generations;
+  };
+
+  std::shared_ptr<State> _state;
+};
+
+// A HashSet whose arrays live in files mapped MAP_SHARED, so that the set
+// survives the process. Inserts, erases and growth write to the mapping like
+// to any other memory; growth maps a new file generation and rehashes into
+// it. flush() makes the current state durable: it msyncs, writes the image
+// header, and deletes every older generation. open() resumes from the newest
+// generation that was flushed.
+//
+// A flushed generation is never written again: the first change after a
+// flush() copies the table into a new generation, since the kernel writes
+// the pages of a mapping back in any order and a change made in place could
+// reach the disk torn. After a crash, the set therefore holds exactly what
+// the last flush() wrote, and changes since are lost, as they are on a clean
+// exit without a flush. That copy makes flushing often costly for a large
+// set.
+template <typename V>
+struct PersistentHashSet {
+  using Table = HashSet<V, 2.0, MappedFileAllocator>;
+
+  static_assert(std::is_trivially_copyable_v<V>,
+                "entries are stored as bytes in a file");
+  static_assert(sizeof(typename Table::ImageHeader) ==
+                MappedFileAllocator::HeaderSize);
+
+  // Open the set stored at `path`, or create an empty one with room for
+  // `initialCapacity` entries if nothing was ever flushed there. Returns
+  // nullopt if the files can't be created or mapped, or if the newest flushed
+  // generation doesn't validate (see HashSet::load()); its files are then
+  // left as they are.
+  static std::optional<PersistentHashSet> open(std::string const& path,
+                                               size_t initialCapacity = 4) {
+    std::map<uint64_t, std::string> const generations = _generations(path);
+    // Generations newer than the last flush never had a header written and
+    // only hold changes since, which are dropped.
+    auto flushed = generations.rbegin();
+    while (flushed != generations.rend() && !_headerWritten(flushed->second)) {
+      ++flushed;
+    }
+    std::optional<PersistentHashSet> set;
+    if (flushed != generations.rend()) {
+      set = _adopt(path, flushed->first);
+      if (!set) {
+        return std::nullopt;
+      }
+    }
+    for (auto const& [generation, file] : generations) {
+      if (!set || generation != flushed->first) {
+        std::filesystem::remove(file);
+      }
+    }
+    if (set) {
+      return set;
+    }
+    try {
+      uint64_t const first =
+          generations.empty() ? 0 : generations.rbegin()->first + 1;
+      return PersistentHashSet(
+          Table(initialCapacity, 1, MappedFileAllocator(path, first)), false);
+    } catch (std::bad_alloc const&) {
+      return std::nullopt;
+    }
+  }
+
+  // Delete every generation of the set stored at `path`.
+  static void remove(std::string const& path) {
+    for (auto const& [generation, file] : _generations(path)) {
+      std::filesystem::remove(file);
+    }
+  }
+
+  // Returns false if an equal entry is already present.
+  bool insert(V const& v) {
+    if (_flushed && _table.contains(v)) {
+      return false;
+    }
+    _beginChange();
+    return _table.upsert(v, [](V&) {});
+  }
+
+  bool contains(V const& v) const { return _table.contains(v); }
+
+  bool erase(V const& v) {
+    if (_flushed && !_table.contains(v)) {
+      return false;
+    }
+    _beginChange();
+    return _table.erase(v);
+  }
+
+  size_t size() const { return _table.size(); }
+
+  // Make everything so far durable and drop older generations. Returns false
+  // if the mapping couldn't be synced, in which case older generations stay.
+  bool flush() {
+    if (_flushed) {
+      return true;
+    }
+    _table._finishMigration();
+    std::byte* const mapping =
+        _table._data.get() - MappedFileAllocator::HeaderSize;
+    size_t const length =
+        MappedFileAllocator::HeaderSize +
+        (_table._groupCount * Table::GroupSize) * (1 + sizeof(V));
+    // The arrays first and the header after, so that a header never marks a
+    // generation valid before its arrays are on disk.
+    if (::msync(mapping, length, MS_SYNC) != 0) {
+      return false;
+    }
+    auto const header =
+        Table::_imageHeader(_table._groupCount, _table._count);
+    std::memcpy(mapping, &header, sizeof(header));
+    if (::msync(mapping, sizeof(header), MS_SYNC) != 0) {
+      return false;
+    }
+    _flushed = true;
+    MappedFileAllocator const& allocator = _table._allocator();
+    uint64_t const current = allocator.generation_of(_table._data.get());
+    for (auto const& [generation, file] : _generations(allocator.path())) {
+      if (generation < current) {
+        std::filesystem::remove(file);
+      }
+    }
+    return true;
+  }
+
+ private:
+  PersistentHashSet(Table table, bool flushed)
+      : _table(std::move(table)), _flushed(flushed) {}
+
+  // Before changing a flushed generation, copy it into a new one.
+  void _beginChange() {
+    if (_flushed) {
+      _table = Table(_table);
+      _flushed = false;
+    }
+  }
+
+  // Whether the generation file at `file` had an image header written, i.e.
+  // was flushed at some point. The header of a new generation is zeros.
+  static bool _headerWritten(std::string const& file) {
+    int const fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    std::array<std::byte, MappedFileAllocator::HeaderSize> header{};
+    ssize_t const read = ::pread(fd, header.data(), header.size(), 0);
+    ::close(fd);
+    return read > 0 && std::ranges::any_of(header, [](std::byte b) {
+             return b != std::byte{0};
+           });
+  }
+
+  // The generation files of the set at `path`, by generation.
+  static std::map<uint64_t, std::string> _generations(
+      std::string const& path) {
+    std::map<uint64_t, std::string> generations;
+    std::filesystem::path const base{path};
+    std::filesystem::path directory = base.parent_path();
+    if (directory.empty()) {
+      directory = ".";
+    }
+    std::string const prefix = base.filename().string() + ".";
+    std::error_code error;
+    for (auto const& file :
+         std::filesystem::directory_iterator(directory, error)) {
+      std::string const name = file.path().filename().string();
+      if (name.size() > prefix.size() && name.starts_with(prefix) &&
+          name.find_first_not_of("0123456789", prefix.size()) ==
+              std::string::npos) {
+        generations[std::stoull(name.substr(prefix.size()))] =
+            file.path().string();
+      }
+    }
+    return generations;
+  }
+
+  // Map generation `generation` of the set at `path` as a table, if it holds
+  // a valid image.
+  static std::optional<PersistentHashSet> _adopt(std::string const& path,
+                                                 uint64_t generation) {
+    std::string const file =
+        MappedFileAllocator::generation_path(path, generation);
+    int const fd = ::open(file.c_str(), O_RDWR);
+    if (fd < 0) {
+      return std::nullopt;
+    }
+    typename Table::ImageHeader header;
+    struct stat status;
+    bool const valid =
+        ::pread(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header)) &&
+        Table::_validHeader(header) && ::fstat(fd, &status) == 0 &&
+        Table::_imageSize(header.groupCount) == size_t(status.st_size);
+    MappedFileAllocator allocator(path, generation + 1);
+    std::byte* data =
+        valid ? allocator.map(fd, status.st_size, generation) : nullptr;
+    ::close(fd);
+    if (data == nullptr) {
+      return std::nullopt;
+    }
+    size_t const size = status.st_size - MappedFileAllocator::HeaderSize;
+    Table table(
+        typename Table::Buffer{data,
+                               typename Table::Deallocate(allocator, size)},
+        header.groupCount, header.count);
+    size_t entries = 0;
+    table.for_each([&](V const&) { entries++; });
+    if (entries != header.count ||
+        !Table::_findsSample(data, header.groupCount)) {
+      return std::nullopt;
+    }
+    return PersistentHashSet(std::move(table), true);
+  }
+
+  Table _table;
+  // Whether the current generation is the one the last flush() wrote, which
+  // must not change any more.
+  bool _flushed = false;
+};
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include "epoch.h"
+#include "hash_set.h"
+
+// A HashSet that one writer thread mutates while any number of threads look
+// keys up without locks or shared writes.
+//
+// Each run of GroupsPerVersion groups has a seqlock version, which the writer
+// makes odd while it modifies one of those groups. Readers run _find
+// optimistically, note the version of each group run they visit and retry if
+// any of them was odd or has changed by the end. Growth never touches the
+// table readers are using: the writer rehashes into a new table, publishes it
+// and retires the old one through an EpochDomain that readers pin.
+//
+// Readers load control bytes atomically, pairing with the writer's atomic
+// stores. Their reads of entries are plain seqlock reads that do race with
+// the writer: a reader may compare a half-written entry before it retries, so
+// V must be trivially copyable, and comparing a torn entry must be harmless.
+template <typename V>
+struct SingleWriterHashSet {
+  using Table = HashSet<V>;
+  static constexpr size_t GroupsPerVersion = 8;
+  // How many version runs a reader tracks before it validates against the
+  // table-wide write counter instead.
+  static constexpr size_t MaxTrackedVersions = 8;
+
+  static_assert(std::is_trivially_copyable_v<V>,
+                "readers may see torn entries");
+
+  SingleWriterHashSet(size_t initialCapacity = 4)
+      : _table(new Versioned(initialCapacity)) {}
+
+  ~SingleWriterHashSet() { delete _table.load(); }
+
+  // Safe to call from any thread, concurrently with the writer.
+  bool contains(V const& v) const {
+    auto const guard = _epochs.pin();
+    Versioned const* table = _table.load();
+    size_t const hash = v.hash();
+    bool tableWide = false;
+    while (true) {
+      uint64_t const writes = table->writes.load(std::memory_order_acquire);
+      std::array<std::pair<size_t, uint64_t>, MaxTrackedVersions> seen;
+      size_t seenCount = 0;
+      bool overflow = false;
+      auto const visit = [&](size_t groupIndex) {
+        size_t const run = groupIndex / GroupsPerVersion;
+        if (tableWide || (seenCount > 0 && seen[seenCount - 1].first == run)) {
+          return;
+        }
+        if (seenCount == MaxTrackedVersions) {
+          overflow = true;
+          return;
+        }
+        seen[seenCount++] = {
+            run, table->versions[run].load(std::memory_order_acquire)};
+      };
+
+      bool const found = _find(table->set, v, hash, visit);
+      std::atomic_thread_fence(std::memory_order_acquire);
+
+      bool valid;
+      if (tableWide) {
+        valid = (writes & 1) == 0 &&
+                table->writes.load(std::memory_order_relaxed) == writes;
+      } else {
+        valid = !overflow;
+        for (size_t i = 0; i < seenCount; ++i) {
+          auto const [run, version] = seen[i];
+          valid &= (version & 1) == 0 &&
+                   table->versions[run].load(std::memory_order_relaxed) ==
+                       version;
+        }
+      }
+      if (valid) {
+        return found;
+      }
+      // A probe too long to track falls back to the table-wide counter.
+      tableWide = overflow;
+      _mm_pause();
+    }
+  }
+
+  // Writer only. Returns false if an equal entry is already present.
+  bool insert(V v) {
+    Versioned* table = _table.load(std::memory_order_relaxed);
+    if (table->set._count > Table::_capacityOf(table->set._groupCount)) {
+      table = _grow(table);
+    }
+    size_t const hash = v.hash();
+    Control* ctrl;
+    V* entry;
+    if (table->set._findOrPrepareInsert(v, hash, ctrl, entry)) {
+      return false;
+    }
+    assert(ctrl != nullptr);
+    _write(*table, ctrl,
+           [&] { table->set._insertAt(ctrl, entry, std::move(v), hash); });
+    return true;
+  }
+
+  // Writer only.
+  bool erase(V const& v) {
+    Versioned* table = _table.load(std::memory_order_relaxed);
+    Control* ctrl;
+    V* entry;
+    if (!table->set._find(v, v.hash(), ctrl, entry)) {
+      return false;
+    }
+    _write(*table, ctrl, [&] { table->set._eraseAt(ctrl, entry); });
+    return true;
+  }
+
+  // Writer only.
+  size_t size() const {
+    return _table.load(std::memory_order_relaxed)->set.size();
+  }
+
+ private:
+  // A table plus the seqlock versions guarding it.
+  struct Versioned {
+    explicit Versioned(size_t capacity)
+        : set(capacity),
+          versions(std::make_unique<std::atomic<uint64_t>[]>(
+              (set._groupCount + GroupsPerVersion - 1) / GroupsPerVersion)),
+          writes(0) {}
+
+    Table set;
+    std::unique_ptr<std::atomic<uint64_t>[]> versions;
+    // Bumped around every write, for readers whose probe was too long to
+    // track run by run.
+    std::atomic<uint64_t> writes;
+  };
+
+  std::atomic<Versioned*> _table;
+  mutable EpochDomain _epochs;
+
+  // Table::_findIn for a reader racing the writer, calling `visit(groupIndex)`
+  // before each group it examines. Each group's control bytes are loaded as
+  // two atomic 8-byte halves; candidate entries are read plainly, and may be
+  // torn.
+  template <typename Visit>
+  static bool _find(Table const& set, V const& v, size_t hash,
+                    Visit&& visit) {
+    Control const tag{uint8_t(hash >> Table::TagShift)};
+    std::byte* data = set._data.get();
+    size_t const groupCount = set._groupCount;
+    size_t groupIndex = Table::_groupOf(hash, groupCount);
+    size_t const initialGroupIndex = groupIndex;
+    do {
+      visit(groupIndex);
+      std::byte* ctrl = data + groupIndex * Table::GroupSize;
+      uint64_t const group[2] = {
+          std::atomic_ref(*reinterpret_cast<uint64_t*>(ctrl))
+              .load(std::memory_order_relaxed),
+          std::atomic_ref(*reinterpret_cast<uint64_t*>(ctrl + 8))
+              .load(std::memory_order_relaxed)};
+      for (int matches = Table::_matchTag(group, tag); matches != 0;
+           matches &= (matches - 1)) {
+        int index = std::countr_zero(static_cast<unsigned int>(matches));
+        V const* candidate = reinterpret_cast<V const*>(
+            data + Table::_getSlotOffset(groupCount, groupIndex, index));
+        if (Table::_equal(*candidate, v)) {
+          return true;
+        }
+      }
+      if (Table::_matchEmpty(group) != 0) {
+        return false;
+      }
+      groupIndex = Table::_nextGroup(groupIndex, groupCount);
+    } while (groupIndex != initialGroupIndex);
+    return false;
+  }
+
+  // Run `write`, which modifies the group holding `ctrl`, inside that group
+  // run's seqlock.
+  template <typename Write>
+  static void _write(Versioned& table, Control* ctrl, Write&& write) {
+    size_t const groupIndex =
+        size_t(reinterpret_cast<std::byte*>(ctrl) - table.set._data.get()) /
+        Table::GroupSize;
+    std::atomic<uint64_t>& version =
+        table.versions[groupIndex / GroupsPerVersion];
+    uint64_t const before = version.load(std::memory_order_relaxed);
+    uint64_t const writes = table.writes.load(std::memory_order_relaxed);
+    version.store(before + 1, std::memory_order_relaxed);
+    table.writes.store(writes + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    write();
+    table.writes.store(writes + 2, std::memory_order_release);
+    version.store(before + 2, std::memory_order_release);
+  }
+
+  // Copy `table` into one with twice the groups, publish it and retire the
+  // old one.
+  Versioned* _grow(Versioned* table) {
+    auto* grown =
+        new Versioned(Table::_capacityOf(2 * table->set._groupCount));
+    table->set.for_each([&](V const& v) { grown->set.insert(v); });
+    _table.store(grown);
+    _epochs.retire(table);
+    return grown;
+  }
+};
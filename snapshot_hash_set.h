@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+
+#include "epoch.h"
+#include "hash_set.h"
+
+// A read-mostly HashSet. Readers pin an epoch and use the current table,
+// which is never modified, so they never block or retry. Writers copy the
+// table (a memcpy of its arrays for trivially copyable V), apply a batch of
+// changes to the copy and publish it with an atomic pointer swap; the old
+// table is freed once every reader that could be using it has unpinned.
+//
+// Each publish copies the whole table, so batch changes together with
+// update() rather than inserting one at a time.
+template <typename V>
+struct SnapshotHashSet {
+  using Table = HashSet<V>;
+
+  SnapshotHashSet(size_t initialCapacity = 4)
+      : _table(new Table(initialCapacity)) {}
+
+  ~SnapshotHashSet() { delete _table.load(); }
+
+  bool contains(V const& v) const {
+    return read([&](Table const& table) { return table.contains(v); });
+  }
+
+  size_t size() const {
+    return read([](Table const& table) { return table.size(); });
+  }
+
+  // Run `fn(table)` on the current table, which doesn't change while `fn`
+  // runs, however many updates are published meanwhile. `fn` may read this
+  // set again, e.g. call contains(), which may see a newer table.
+  template <typename Fn>
+  auto read(Fn&& fn) const {
+    auto const guard = _epochs.pin();
+    return fn(*_table.load());
+  }
+
+  // Apply `fn(table)` to a copy of the current table and publish the result.
+  // Writers are serialized with each other.
+  template <typename Fn>
+  void update(Fn&& fn) {
+    std::lock_guard guard{_writeLock};
+    Table* next = new Table(*_table.load());
+    fn(*next);
+    _epochs.retire(_table.exchange(next));
+  }
+
+  bool insert(V v) {
+    bool inserted;
+    update([&](Table& table) { inserted = table.insert(std::move(v)); });
+    return inserted;
+  }
+
+  bool erase(V const& v) {
+    bool erased;
+    update([&](Table& table) { erased = table.erase(v); });
+    return erased;
+  }
+
+ private:
+  std::atomic<Table*> _table;
+  mutable EpochDomain _epochs;
+  std::mutex _writeLock;
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#else
+#include "sse2neon.h"
+#endif
+
+// A one-byte test-and-test-and-set lock, for guarding short critical sections
+// where a std::mutex per guarded unit would be too big.
+struct SpinLock {
+  // Spins this many times before yielding the thread.
+  static constexpr int SpinsBeforeYield = 64;
+
+  void lock() {
+    while (_locked.exchange(true, std::memory_order_acquire)) {
+      for (int spins = 0; _locked.load(std::memory_order_relaxed); ++spins) {
+        if (spins < SpinsBeforeYield) {
+          _mm_pause();
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    }
+  }
+
+  bool try_lock() {
+    return !_locked.load(std::memory_order_relaxed) &&
+           !_locked.exchange(true, std::memory_order_acquire);
+  }
+
+  void unlock() { _locked.store(false, std::memory_order_release); }
+
+ private:
+  std::atomic<bool> _locked = false;
+};
@@ -0,0 +1,393 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "hash_set.h"
+#include "spin_lock.h"
+
+// A thread-safe HashSet that is one flat table, with a lock per run of
+// GroupsPerStripe groups instead of a lock per table. An operation locks the
+// stripes of just the groups its probe visits, so operations on different
+// parts of the table run in parallel. Growth takes every stripe.
+//
+// There are StripeCount stripes whatever the table size; once a table has
+// more group runs than that, a stripe covers every StripeCount-th run.
+//
+// Erases leave tombstones, which lengthen probes like entries do, so they
+// count towards the load factor: once entries and tombstones cross it, the
+// table is rehashed under every stripe, at the same size if that leaves
+// enough room. A probe that still needs more than MaxHeldStripes stripes runs
+// under every stripe instead of retrying.
+template <typename V>
+struct StripedHashSet {
+  using Table = HashSet<V>;
+  static constexpr size_t GroupsPerStripe = 8;
+  static constexpr size_t StripeCount = 1024;
+  // The most stripes one probe may hold before it gives up and runs under
+  // every stripe.
+  static constexpr size_t MaxHeldStripes = 16;
+
+  StripedHashSet(size_t initialCapacity = 4)
+      : _table(initialCapacity),
+        _size(0),
+        _tombstones(0),
+        _groupCount(_table._groupCount) {}
+
+  bool insert(V v) {
+    size_t const hash = v.hash();
+    while (true) {
+      size_t const groupCount = _groupCount.load(std::memory_order_acquire);
+      size_t const size = _size.load(std::memory_order_relaxed);
+      if (!_fits(groupCount, size)) {
+        _makeRoom(groupCount, size);
+        continue;
+      }
+      InsertResult const result = _locked(hash, [&](StripeGuard& guard) {
+        Control* ctrl;
+        V* entry;
+        if (_table._findOrPrepareInsert(v, hash, ctrl, entry, guard)) {
+          return InsertResult::Present;
+        }
+        if (ctrl == nullptr) {
+          return InsertResult::Full;
+        }
+        _fill(ctrl, entry, std::move(v), hash);
+        return InsertResult::Inserted;
+      });
+      if (result != InsertResult::Full) {
+        return result == InsertResult::Inserted;
+      }
+      // A burst of concurrent inserts used up the headroom above the load
+      // factor before any of them could grow the table.
+      _grow(groupCount);
+    }
+  }
+
+  bool contains(V const& v) const {
+    size_t const hash = v.hash();
+    return _locked(hash, [&](StripeGuard& guard) {
+      Control* ctrl;
+      V* entry;
+      return _table._find(v, hash, ctrl, entry, guard);
+    });
+  }
+
+  bool erase(V const& v) {
+    size_t const hash = v.hash();
+    return _locked(hash, [&](StripeGuard& guard) {
+      Control* ctrl;
+      V* entry;
+      if (!_table._find(v, hash, ctrl, entry, guard)) {
+        return false;
+      }
+      _table._clearSlot(ctrl, entry);
+      _size.fetch_sub(1, std::memory_order_relaxed);
+      if (*ctrl == Control::Removed) {
+        _tombstones.fetch_add(1, std::memory_order_relaxed);
+      }
+      return true;
+    });
+  }
+
+  // Insert `values` in one pass ordered by group. Values whose probes start
+  // in the same run of groups are inserted under one acquisition of its
+  // stripe, so a batch takes each lock once per run rather than once per
+  // value. Returns how many values were inserted; the rest were already
+  // present.
+  size_t insert_batch(std::span<V const> values) {
+    struct Pending {
+      size_t groupIndex;
+      size_t hash;
+      V const* value;
+    };
+    size_t const count = _size.load(std::memory_order_relaxed) + values.size();
+    if (size_t const groupCount =
+            _groupCount.load(std::memory_order_acquire);
+        !_fits(groupCount, count)) {
+      _makeRoom(groupCount, count);
+    }
+    size_t const groupCount = _groupCount.load(std::memory_order_acquire);
+    std::vector<Pending> pending;
+    pending.reserve(values.size());
+    for (V const& v : values) {
+      size_t const hash = v.hash();
+      pending.push_back({Table::_groupOf(hash, groupCount), hash, &v});
+    }
+    // In group order the pass walks the table front to back, and values
+    // under the same run of GroupsPerStripe groups end up next to each other.
+    std::sort(pending.begin(), pending.end(),
+              [](Pending const& a, Pending const& b) {
+                return a.groupIndex < b.groupIndex;
+              });
+
+    size_t inserted = 0;
+    // Values that couldn't go in under their stripe's run, because of a
+    // concurrent growth, an abandoned probe or a full table. insert() takes
+    // them one at a time, and runs any whose probe needs too many stripes
+    // under every stripe.
+    std::vector<V const*> leftover;
+    for (auto run = pending.begin(); run != pending.end();) {
+      size_t const block = run->groupIndex / GroupsPerStripe;
+      auto const runEnd =
+          std::find_if(run, pending.end(), [&](Pending const& p) {
+            return p.groupIndex / GroupsPerStripe != block;
+          });
+      StripeGuard guard{*this};
+      guard(run->groupIndex);
+      bool const stale =
+          groupCount != _groupCount.load(std::memory_order_acquire);
+      for (; run != runEnd; ++run) {
+        Control* ctrl;
+        V* entry;
+        if (stale || guard.abandoned) {
+          leftover.push_back(run->value);
+        } else if (!_table._findOrPrepareInsert(*run->value, run->hash, ctrl,
+                                                entry, guard)) {
+          if (ctrl == nullptr) {
+            leftover.push_back(run->value);
+          } else {
+            _fill(ctrl, entry, V(*run->value), run->hash);
+            inserted++;
+          }
+        }
+      }
+    }
+    for (V const* v : leftover) {
+      inserted += insert(*v);
+    }
+    return inserted;
+  }
+
+  size_t size() const { return _size.load(std::memory_order_relaxed); }
+
+  // HashSet::stats() of the table, taken under every stripe.
+  typename Table::Stats stats() const {
+    _lockAll();
+    typename Table::Stats const stats = _table.stats();
+    _unlockAll();
+    return stats;
+  }
+
+ private:
+  struct alignas(64) Stripe {
+    mutable SpinLock lock;
+  };
+
+  // The stripes one operation holds, taken in probe order. Stripes with a
+  // higher index than any already held are waited for; anything else could
+  // deadlock, so it is only tried, and on failure the probe is abandoned, the
+  // stripes are released and the operation starts over. A probe that would
+  // need more than MaxHeldStripes stripes is abandoned as `saturated`, and
+  // starting over the same way would only fail again.
+  struct StripeGuard {
+    // For an operation that already holds every stripe.
+    struct AllHeld {};
+
+    explicit StripeGuard(StripedHashSet const& owner) : _owner(owner) {}
+    StripeGuard(StripedHashSet const& owner, AllHeld)
+        : _owner(owner), _allHeld(true) {}
+    StripeGuard(StripeGuard const&) = delete;
+    ~StripeGuard() { release(); }
+
+    // The visitor for HashSet::_find: lock the stripe covering `groupIndex`.
+    bool operator()(size_t groupIndex) {
+      if (_allHeld) {
+        return true;
+      }
+      size_t const stripe = _stripeOf(groupIndex);
+      for (size_t i = 0; i < _count; ++i) {
+        if (_stripes[i] == stripe) {
+          return true;
+        }
+      }
+      if (_count == MaxHeldStripes) {
+        abandoned = saturated = true;
+        return false;
+      }
+      SpinLock& lock = _owner._stripes[stripe].lock;
+      if (_count == 0 || stripe > _highest) {
+        lock.lock();
+        _highest = stripe;
+      } else if (!lock.try_lock()) {
+        abandoned = true;
+        return false;
+      }
+      _stripes[_count++] = stripe;
+      return true;
+    }
+
+    void release() {
+      for (size_t i = 0; i < _count; ++i) {
+        _owner._stripes[_stripes[i]].lock.unlock();
+      }
+      _count = 0;
+    }
+
+    bool abandoned = false;
+    bool saturated = false;
+
+   private:
+    StripedHashSet const& _owner;
+    bool const _allHeld = false;
+    std::array<size_t, MaxHeldStripes> _stripes;
+    size_t _count = 0;
+    size_t _highest = 0;
+  };
+
+  enum class InsertResult { Present, Inserted, Full };
+
+  Table _table;
+  std::atomic<size_t> _size;
+  // Removed control bytes, which only a rehash clears.
+  std::atomic<size_t> _tombstones;
+  // Mirrors _table._groupCount so that it can be read before taking a stripe.
+  std::atomic<size_t> _groupCount;
+  std::array<Stripe, StripeCount> _stripes;
+  static size_t _stripeOf(size_t groupIndex) {
+    return (groupIndex / GroupsPerStripe) % StripeCount;
+  }
+
+  // Fill the free slot behind `ctrl`, held under its stripe.
+  void _fill(Control* ctrl, V* entry, V&& v, size_t hash) {
+    if (*ctrl == Control::Removed) {
+      _tombstones.fetch_sub(1, std::memory_order_relaxed);
+    }
+    _table._fillSlot(ctrl, entry, std::move(v), hash);
+    _size.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Run `op(guard)` with the stripe of `hash`'s first group locked, where
+  // `op` probes with `guard` as its visitor to lock the rest of its groups.
+  // If the probe had to be abandoned, `op` must not have changed anything; its
+  // result is dropped and it runs again, under every stripe if the probe was
+  // saturated.
+  template <typename Op>
+  auto _locked(size_t hash, Op&& op) const {
+    while (true) {
+      StripeGuard guard{*this};
+      size_t const groupCount = _groupCount.load(std::memory_order_acquire);
+      guard(Table::_groupOf(hash, groupCount));
+      // Growth needs every stripe, so once we hold one the table can only have
+      // changed before we took it.
+      if (groupCount != _groupCount.load(std::memory_order_acquire)) {
+        continue;
+      }
+      auto const result = op(guard);
+      if (!guard.abandoned) {
+        return result;
+      }
+      guard.release();
+      if (guard.saturated) {
+        _lockAll();
+        StripeGuard all{*this, typename StripeGuard::AllHeld{}};
+        auto const result = op(all);
+        _unlockAll();
+        return result;
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  // Whether `count` entries and the current tombstones fit in `groupCount`
+  // groups without crossing the load factor.
+  bool _fits(size_t groupCount, size_t count) const {
+    return count + _tombstones.load(std::memory_order_relaxed) <=
+           Table::_capacityOf(groupCount);
+  }
+
+  // Make room for `count` entries plus the tombstones, unless another thread
+  // already changed the table from `groupCount` groups: rehash at the same
+  // size, which clears the tombstones, if that leaves an eighth of the
+  // capacity free, and grow otherwise.
+  void _makeRoom(size_t groupCount, size_t count) {
+    _withAllStripes([&] {
+      if (_table._groupCount != groupCount || _fits(groupCount, count)) {
+        return;
+      }
+      size_t const capacity = Table::_capacityOf(groupCount);
+      if (count <= capacity - capacity / 8) {
+        _table._rehash(groupCount);
+      } else {
+        _table._rehash(std::max(Table::_groupsFor(count),
+                                Table::_grownGroupCount(groupCount)));
+      }
+      _tombstones.store(0, std::memory_order_relaxed);
+    });
+  }
+
+  // Take every stripe, in order, and grow the table unless another thread
+  // already grew it from `groupCount`.
+  void _grow(size_t groupCount) {
+    _withAllStripes([&] {
+      if (_groupCount.load(std::memory_order_relaxed) == groupCount) {
+        _table._rehash();
+        _tombstones.store(0, std::memory_order_relaxed);
+      }
+    });
+  }
+
+  // Run `resize` holding every stripe, then publish the new group count.
+  template <typename Resize>
+  void _withAllStripes(Resize&& resize) {
+    _lockAll();
+    _table._count = _size.load(std::memory_order_relaxed);
+    resize();
+    _groupCount.store(_table._groupCount, std::memory_order_release);
+    _unlockAll();
+  }
+
+  // Take every stripe, in order.
+  void _lockAll() const {
+    for (Stripe const& stripe : _stripes) {
+      stripe.lock.lock();
+    }
+  }
+
+  void _unlockAll() const {
+    for (Stripe const& stripe : _stripes) {
+      stripe.lock.unlock();
+    }
+  }
+};
+
+// Stages one thread's inserts and hands them to a StripedHashSet with
+// insert_batch() whenever Capacity of them have built up, so the thread takes
+// each stripe lock once per batch instead of once per insert. Staged values
+// only become visible in the set when they are flushed; the destructor
+// flushes whatever is left.
+template <typename V>
+struct StagedInserter {
+  static constexpr size_t DefaultCapacity = 4096;
+
+  explicit StagedInserter(StripedHashSet<V>& set,
+                          size_t capacity = DefaultCapacity)
+      : _set(set), _capacity(capacity) {
+    _staged.reserve(capacity);
+  }
+
+  StagedInserter(StagedInserter const&) = delete;
+
+  ~StagedInserter() { flush(); }
+
+  void insert(V v) {
+    _staged.push_back(std::move(v));
+    if (_staged.size() == _capacity) {
+      flush();
+    }
+  }
+
+  void flush() {
+    _set.insert_batch(_staged);
+    _staged.clear();
+  }
+
+ private:
+  StripedHashSet<V>& _set;
+  size_t _capacity;
+  std::vector<V> _staged;
+};
@@ -1,11 +1,31 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <chrono>
+#include <cstdio>
+#include <limits>
+#include <memory_resource>
+#include <span>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "array_pool.h"
+#include "concurrent_hash_set.h"
+#include "counting_hash_map.h"
 #include "data.h"
 #include "hash_set.h"
+#include "insert_only_hash_set.h"
+#include "mapped_hash_set.h"
+#include "mremap_allocator.h"
+#include "out_of_line_hash_set.h"
+#include "persistent_hash_set.h"
+#include "single_writer_hash_set.h"
+#include "snapshot_hash_set.h"
+#include "striped_hash_set.h"
 
 struct Timer {
   Timer(char const* message)
@@ -30,6 +50,16 @@ std::vector<Data> GenerateDataset(size_t size) {
   return result;
 }
 
+// Distinct values, in the shape of a deduplicated export.
+std::vector<Data> GenerateUniqueDataset(size_t size) {
+  std::vector<Data> result{};
+  result.resize(size);
+  for (size_t i = 0; i < size; ++i) {
+    result[i] = {int(i), rand(), rand() / 3.14};
+  }
+  return result;
+}
+
 template <typename Container>
 void RunTestCode(Container& container, std::vector<Data> const& values) {
   for (Data const& val : values) {
@@ -44,6 +74,941 @@ void RunTestCode(Container& container, std::vector<Data> const& values) {
   }
 }
 
+void RunEraseBatchTestCode(HashSet<Data>& container,
+                           std::vector<Data> const& values) {
+  for (Data const& val : values) {
+    container.insert(val);
+  }
+  size_t const half = values.size() / 2;
+  std::span<Data const> const all{values};
+  assert(container.erase_batch(all.first(half)) == half);
+  // Erasing again finds nothing.
+  assert(container.erase_batch(all.first(half)) == 0);
+  for (size_t i = 0; i < values.size(); ++i) {
+    assert(container.contains(values[i]) == (i >= half));
+  }
+  assert(container.erase_batch(all) == values.size() - half);
+}
+
+template <typename Container>
+void RunBuildFromUniqueTestCode(Container& container,
+                                std::vector<Data> const& values) {
+  container.build_from_unique(values);
+  for (Data const& val : values) {
+    assert(container.contains(val));
+  }
+  for (Data const& val : values) {
+    assert(container.erase(val));
+  }
+}
+
+// Look values up the way a caller pipelining its own work would: prefetch a
+// few keys ahead and resolve each token later.
+void RunSplitPhaseLookupTestCode(HashSet<Data>& container,
+                                 std::vector<Data> const& values) {
+  constexpr size_t Ahead = 4;
+  for (Data const& val : values) {
+    container.insert(val);
+  }
+  std::array<HashSet<Data>::ProbeToken, Ahead> tokens;
+  for (size_t i = 0; i < values.size() + Ahead; ++i) {
+    if (i >= Ahead) {
+      Data const& val = values[i - Ahead];
+      assert(container.contains(tokens[i % Ahead], val));
+      assert(container.find(tokens[i % Ahead], val) != nullptr);
+    }
+    if (i < values.size()) {
+      tokens[i % Ahead] = container.prefetch(values[i]);
+    }
+  }
+  Data const missing{-1, -1, 0.0};
+  assert(!container.contains(container.prefetch(missing), missing));
+}
+
+// Count keys that repeat, checking against the counts std::unordered_map
+// gives.
+void RunCountingTestCode(std::vector<Data> const& values) {
+  size_t const distinct = values.size() / 10 + 1;
+  std::vector<Data> keys;
+  for (size_t i = 0; i < values.size(); ++i) {
+    keys.push_back(values[i % distinct]);
+  }
+
+  std::unordered_map<Data, uint64_t> expected;
+  {
+    Timer timer{"std::unordered_map counting"};
+    for (Data const& key : keys) {
+      expected[key]++;
+    }
+  }
+
+  CountingHashMap<Data> counts;
+  {
+    Timer timer{"CountingHashMap increment_batch"};
+    counts.increment_batch(keys);
+  }
+  assert(counts.size() == expected.size());
+  for (auto const& [key, count] : expected) {
+    assert(counts.count(key) == count);
+    assert(counts.increment(key) == count + 1);
+  }
+  assert(counts.count({-1, -1, 0.0}) == 0);
+}
+
+// Run one pass over `values` across `threadCount` threads. Each value is
+// owned by one thread and gets either a lookup (readPercent of the time) or a
+// write that toggles its presence. Even-indexed values start out present.
+template <typename Container>
+void RunConcurrentWorkload(Container& container,
+                           std::vector<Data> const& values, size_t threadCount,
+                           size_t readPercent) {
+  auto const isRead = [&](size_t i) { return (i * 37) % 100 < readPercent; };
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < threadCount; ++t) {
+    threads.emplace_back([&, t] {
+      for (size_t i = t; i < values.size(); i += threadCount) {
+        if (isRead(i)) {
+          bool const found = container.contains(values[i]);
+          assert(found == (i % 2 == 0));
+        } else if (!container.erase(values[i])) {
+          container.insert(values[i]);
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  for (size_t i = 0; i < values.size(); ++i) {
+    assert(container.contains(values[i]) == ((i % 2 == 0) == isRead(i)));
+  }
+}
+
+// Time RunConcurrentWorkload for read-heavy, mixed and write-heavy operation
+// mixes from 1 to 64 threads.
+template <typename Container>
+void BenchmarkConcurrent(char const* name, std::vector<Data> const& values) {
+  struct Mix {
+    char const* name;
+    size_t readPercent;
+  };
+  for (Mix const mix : {Mix{"read-heavy", 95}, Mix{"mixed", 50},
+                        Mix{"write-heavy", 10}}) {
+    for (size_t threadCount = 1; threadCount <= 64; threadCount *= 2) {
+      Container container;
+      for (size_t i = 0; i < values.size(); i += 2) {
+        container.insert(values[i]);
+      }
+      std::string const label = std::string(name) + " " + mix.name + ", " +
+                                std::to_string(threadCount) + " threads";
+      Timer timer{label.c_str()};
+      RunConcurrentWorkload(container, values, threadCount, mix.readPercent);
+    }
+  }
+}
+
+// One writer thread inserts and then erases the odd-indexed values while
+// `readerCount` threads keep looking up the even-indexed ones, which are
+// present throughout.
+template <typename Container>
+void RunReadMostlyWorkload(Container& container,
+                           std::vector<Data> const& values,
+                           size_t readerCount) {
+  for (size_t i = 0; i < values.size(); i += 2) {
+    container.insert(values[i]);
+  }
+  std::atomic<bool> writing = true;
+  std::vector<std::thread> readers;
+  for (size_t t = 0; t < readerCount; ++t) {
+    readers.emplace_back([&, t] {
+      do {
+        for (size_t i = 2 * t; i < values.size(); i += 2 * readerCount) {
+          bool const found = container.contains(values[i]);
+          assert(found);
+        }
+      } while (writing);
+    });
+  }
+  for (size_t i = 1; i < values.size(); i += 2) {
+    container.insert(values[i]);
+  }
+  for (size_t i = 1; i < values.size(); i += 2) {
+    assert(container.erase(values[i]));
+  }
+  writing = false;
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+  for (size_t i = 0; i < values.size(); ++i) {
+    assert(container.contains(values[i]) == (i % 2 == 0));
+  }
+}
+
+template <typename Container>
+void BenchmarkReadMostly(char const* name, std::vector<Data> const& values) {
+  for (size_t readerCount = 1; readerCount <= 16; readerCount *= 4) {
+    Container container;
+    std::string const label = std::string(name) + " read-mostly, " +
+                              std::to_string(readerCount) + " readers";
+    Timer timer{label.c_str()};
+    RunReadMostlyWorkload(container, values, readerCount);
+  }
+}
+
+// Time growing a table holding `values` to twice its groups, with the rehash
+// split across 1 to 8 threads.
+void BenchmarkParallelRehash(std::vector<Data> const& values) {
+  for (size_t threadCount = 1; threadCount <= 8; threadCount *= 2) {
+    HashSet<Data> hs(values.size());
+    hs.build_from_unique(values);
+    hs.set_rehash_threads(threadCount);
+    {
+      std::string const label = "Flat HashSet rehash of " +
+                                std::to_string(values.size()) + " entries, " +
+                                std::to_string(threadCount) + " threads";
+      Timer timer{label.c_str()};
+      hs.reserve(2 * values.size());
+    }
+    for (Data const& val : values) {
+      assert(hs.contains(val));
+    }
+  }
+}
+
+// Time constructing a table for `capacity` entries with its arrays
+// initialized from 1 to 8 threads, then scattering `values` over it, which
+// faults in whatever pages initializing left untouched.
+void BenchmarkParallelInit(size_t capacity, std::vector<Data> const& values) {
+  for (size_t threadCount = 1; threadCount <= 8; threadCount *= 2) {
+    std::string const label = "Flat HashSet init for " +
+                              std::to_string(capacity) + " entries, " +
+                              std::to_string(threadCount) + " threads";
+    Timer timer{label.c_str()};
+    HashSet<Data> hs(capacity, threadCount);
+    hs.build_from_unique(values);
+    assert(hs.size() == values.size());
+  }
+}
+
+// Sum a field over every entry with parallel_reduce, and count entries with
+// parallel_for_each, from 1 to 8 threads.
+void BenchmarkParallelScan(std::vector<Data> const& values) {
+  HashSet<Data> hs(values.size());
+  hs.build_from_unique(values);
+  int64_t expected = 0;
+  hs.for_each([&](Data const& val) { expected += val.x; });
+  for (size_t threadCount = 1; threadCount <= 8; threadCount *= 2) {
+    std::string const label = "Flat HashSet parallel_reduce over " +
+                              std::to_string(values.size()) + " entries, " +
+                              std::to_string(threadCount) + " threads";
+    Timer timer{label.c_str()};
+    int64_t const sum = hs.parallel_reduce(
+        int64_t{0}, [](int64_t& acc, Data const& val) { acc += val.x; },
+        std::plus<int64_t>{}, threadCount);
+    assert(sum == expected);
+  }
+  std::atomic<size_t> count = 0;
+  hs.parallel_for_each([&](Data const&) { count.fetch_add(1); }, 4);
+  assert(count == values.size());
+}
+
+// Insert `values` into a table that grows by GrowthFactor, then look every
+// one up, and report the memory it ended up with.
+template <double GrowthFactor>
+void BenchmarkGrowthFactor(std::vector<Data> const& values) {
+  HashSet<Data, GrowthFactor> hs;
+  std::string const label =
+      "Flat HashSet growth factor " + std::to_string(GrowthFactor);
+  {
+    Timer timer{label.c_str()};
+    for (Data const& val : values) {
+      hs.insert(val);
+    }
+    for (Data const& val : values) {
+      assert(hs.contains(val));
+    }
+  }
+  auto const stats = hs.stats();
+  std::cout << label << ": " << stats.bytes_per_entry
+            << " bytes per entry, load factor " << stats.load_factor << "\n";
+}
+
+// Create, fill and destroy `setCount` small sets, taking their memory from
+// the global heap or from a monotonic buffer released after each set.
+void BenchmarkShortLivedSets(std::vector<Data> const& values,
+                             size_t setCount) {
+  size_t const setSize = std::min<size_t>(values.size(), 256);
+  {
+    Timer timer{"Flat HashSet short-lived sets, global heap"};
+    for (size_t i = 0; i < setCount; ++i) {
+      HashSet<Data> hs;
+      for (size_t j = 0; j < setSize; ++j) {
+        hs.insert(values[j]);
+      }
+      assert(hs.size() == setSize);
+    }
+  }
+  {
+    Timer timer{"Flat HashSet short-lived sets, monotonic buffer"};
+    std::array<std::byte, 64 * 1024> buffer;
+    std::pmr::monotonic_buffer_resource resource{buffer.data(), buffer.size()};
+    for (size_t i = 0; i < setCount; ++i) {
+      {
+        pmr::HashSet<Data> hs(&resource);
+        for (size_t j = 0; j < setSize; ++j) {
+          hs.insert(values[j]);
+        }
+        assert(hs.size() == setSize);
+      }
+      resource.release();
+    }
+  }
+  {
+    Timer timer{"Flat HashSet short-lived sets, array pool"};
+    ArrayPool pool;
+    PooledAllocator<std::byte> const allocator{&pool};
+    for (size_t i = 0; i < setCount; ++i) {
+      HashSet<Data, 2.0, PooledAllocator<std::byte>> hs(allocator);
+      assert(!hs.contains(values[0]));  // Recycled arrays come back empty.
+      for (size_t j = 0; j < setSize; ++j) {
+        hs.insert(values[j]);
+      }
+      assert(hs.size() == setSize);
+    }
+  }
+}
+
+// Insert `values` one at a time, timing each insert, and report the slowest
+// and the 99.99th percentile insert.
+void ReportInsertLatency(char const* name, HashSet<Data>& container,
+                         std::vector<Data> const& values) {
+  std::vector<std::chrono::nanoseconds> latencies;
+  latencies.reserve(values.size());
+  for (Data const& val : values) {
+    auto const start = std::chrono::steady_clock::now();
+    container.insert(val);
+    latencies.push_back(std::chrono::steady_clock::now() - start);
+  }
+  std::sort(latencies.begin(), latencies.end());
+  std::cout << name << " insert latency: p99.99 "
+            << latencies[latencies.size() * 9999 / 10000].count()
+            << "ns, max " << latencies.back().count() << "ns\n";
+  for (Data const& val : values) {
+    assert(container.contains(val));
+  }
+}
+
+// Compare the worst inserts of stop-the-world growth with incremental growth.
+void BenchmarkInsertLatency(std::vector<Data> const& values) {
+  {
+    HashSet<Data> hs;
+    ReportInsertLatency("Flat HashSet stop-the-world growth", hs, values);
+  }
+  {
+    HashSet<Data> hs;
+    hs.set_incremental_growth(4);
+    ReportInsertLatency("Flat HashSet incremental growth", hs, values);
+  }
+}
+
+// Readers look up the even-indexed values, which are always present, while
+// the odd-indexed ones are published in batches and then erased in batches.
+void RunSnapshotTestCode(std::vector<Data> const& values, size_t readerCount) {
+  constexpr size_t BatchSize = 1000;
+  SnapshotHashSet<Data> set;
+  set.update([&](HashSet<Data>& table) {
+    for (size_t i = 0; i < values.size(); i += 2) {
+      table.insert(values[i]);
+    }
+  });
+  std::atomic<bool> writing = true;
+  std::vector<std::thread> readers;
+  for (size_t t = 0; t < readerCount; ++t) {
+    readers.emplace_back([&, t] {
+      do {
+        for (size_t i = 2 * t; i < values.size(); i += 2 * readerCount) {
+          bool const found = set.contains(values[i]);
+          assert(found);
+        }
+        // A nested read; the table read() passed must outlive the inner one.
+        set.read([&](HashSet<Data> const& table) {
+          size_t const before = table.size();
+          bool const found = set.contains(values[2 * t]);
+          assert(found && table.size() == before);
+        });
+      } while (writing);
+    });
+  }
+  for (size_t first = 1; first < values.size(); first += 2 * BatchSize) {
+    size_t const last = std::min(first + 2 * BatchSize, values.size());
+    set.update([&](HashSet<Data>& table) {
+      for (size_t i = first; i < last; i += 2) {
+        table.insert(values[i]);
+      }
+    });
+  }
+  assert(set.size() == values.size());
+  for (size_t first = 1; first < values.size(); first += 2 * BatchSize) {
+    size_t const last = std::min(first + 2 * BatchSize, values.size());
+    set.update([&](HashSet<Data>& table) {
+      for (size_t i = first; i < last; i += 2) {
+        assert(table.erase(values[i]));
+      }
+    });
+  }
+  writing = false;
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+  for (size_t i = 0; i < values.size(); ++i) {
+    assert(set.contains(values[i]) == (i % 2 == 0));
+  }
+}
+
+// Insert `values` from `threadCount` threads, each taking an interleaved
+// slice, either directly or through a StagedInserter per thread.
+void RunStripedIngest(StripedHashSet<Data>& container,
+                      std::vector<Data> const& values, size_t threadCount,
+                      bool staged) {
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < threadCount; ++t) {
+    threads.emplace_back([&, t] {
+      if (staged) {
+        StagedInserter<Data> inserter{container};
+        for (size_t i = t; i < values.size(); i += threadCount) {
+          inserter.insert(values[i]);
+        }
+      } else {
+        for (size_t i = t; i < values.size(); i += threadCount) {
+          container.insert(values[i]);
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  assert(container.size() == values.size());
+  for (Data const& val : values) {
+    assert(container.contains(val));
+  }
+}
+
+// Compare direct concurrent inserts with thread-local staging merged in
+// batches, into a fresh table and into a churned one, which has held and lost
+// as many other keys and so starts out full of tombstones.
+void BenchmarkStripedIngest(std::vector<Data> const& values) {
+  for (size_t threadCount = 1; threadCount <= 16; threadCount *= 4) {
+    for (bool const churned : {false, true}) {
+      for (bool const staged : {false, true}) {
+        StripedHashSet<Data> container;
+        if (churned) {
+          for (Data const& val : values) {
+            container.insert({val.x, val.y, -1.0});
+          }
+          for (Data const& val : values) {
+            container.erase({val.x, val.y, -1.0});
+          }
+        }
+        std::string const label =
+            std::string("StripedHashSet ") +
+            (staged ? "staged batch" : "direct") + " ingest" +
+            (churned ? " into a churned table, " : ", ") +
+            std::to_string(threadCount) + " threads";
+        Timer timer{label.c_str()};
+        RunStripedIngest(container, values, threadCount, staged);
+      }
+    }
+  }
+}
+
+// Keep a striped table at a steady size through `rounds` of insert-then-erase.
+// The erases leave tombstones in full groups; unless the table clears them,
+// probes grow until they need more stripes than a probe may hold.
+void RunStripedChurnTestCode(size_t rounds) {
+  constexpr int Live = 8000;
+  StripedHashSet<Data> set(16 * 1024);
+  for (int i = 0; i < Live; ++i) {
+    set.insert({i, 0, 0.0});
+  }
+  for (int i = Live; i < Live + int(rounds); ++i) {
+    assert(set.insert({i, 0, 0.0}));
+    assert(set.erase({i - Live, 0, 0.0}));
+  }
+  assert(set.size() == Live);
+  auto const stats = set.stats();
+  assert(stats.entries + stats.tombstones <=
+         stats.slots * HashSet<Data>::MaxLoadFactor);
+  assert(stats.longest_probe_run <
+         StripedHashSet<Data>::GroupsPerStripe *
+             StripedHashSet<Data>::MaxHeldStripes);
+}
+
+// Have `threadCount` threads each insert every value, starting at different
+// offsets, so that most inserts race with an insert of the same key. Exactly
+// one insert per key may succeed.
+void RunInsertOnlyDedup(std::vector<Data> const& values, size_t threadCount) {
+  InsertOnlyHashSet<Data> container;
+  std::atomic<size_t> inserted = 0;
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < threadCount; ++t) {
+    threads.emplace_back([&, t] {
+      size_t local = 0;
+      size_t const offset = t * values.size() / threadCount;
+      for (size_t i = 0; i < values.size(); ++i) {
+        Data const& val = values[(offset + i) % values.size()];
+        local += container.insert(val);
+        assert(container.contains(val));
+      }
+      inserted += local;
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  assert(inserted == values.size());
+  assert(container.size() == values.size());
+  for (Data const& val : values) {
+    assert(container.contains(val));
+  }
+}
+
+void BenchmarkInsertOnlyDedup(std::vector<Data> const& values) {
+  for (size_t threadCount = 1; threadCount <= 16; threadCount *= 4) {
+    std::string const label = "InsertOnlyHashSet overlapping ingest, " +
+                              std::to_string(threadCount) + " threads";
+    Timer timer{label.c_str()};
+    RunInsertOnlyDedup(values, threadCount);
+  }
+}
+
+// Drain a table with auto-shrinking on, and another one followed by
+// shrink_to_fit; both should end up as small as an empty table.
+void RunShrinkTestCode(std::vector<Data> const& values) {
+  size_t const emptyBytes = HashSet<Data>().stats().bytes_allocated;
+  for (bool const automatic : {true, false}) {
+    HashSet<Data> hs;
+    if (automatic) {
+      hs.set_shrink_load_factor(0.1);
+    }
+    for (Data const& val : values) {
+      hs.insert(val);
+    }
+    size_t const peakBytes = hs.stats().bytes_allocated;
+    for (size_t i = 0; i < values.size(); ++i) {
+      assert(hs.erase(values[i]));
+      if (i == values.size() * 9 / 10) {
+        assert(hs.stats().bytes_allocated < peakBytes || !automatic);
+        for (size_t j = i + 1; j < values.size(); ++j) {
+          assert(hs.contains(values[j]));
+        }
+      }
+    }
+    if (!automatic) {
+      assert(hs.stats().bytes_allocated == peakBytes);
+      hs.shrink_to_fit();
+    }
+    assert(hs.size() == 0);
+    assert(hs.stats().bytes_allocated == emptyBytes);
+  }
+}
+
+// A memory resource that counts the bytes it has outstanding.
+struct CountingResource : std::pmr::memory_resource {
+  size_t outstanding = 0;
+
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    outstanding += bytes;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+  }
+  void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+    outstanding -= bytes;
+    std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+  }
+  bool do_is_equal(memory_resource const& other) const noexcept override {
+    return this == &other;
+  }
+};
+
+// Copy a pmr table in the middle of an incremental migration. The copy takes
+// both of its arrays from the default resource, which is what
+// polymorphic_allocator selects for a copy, and none from the original's.
+void RunCopyDuringMigrationTestCode(std::vector<Data> const& values) {
+  CountingResource original;
+  CountingResource fallback;
+  std::pmr::memory_resource* const previous =
+      std::pmr::set_default_resource(&fallback);
+  {
+    pmr::HashSet<Data> hs(&original);
+    hs.set_incremental_growth(1);
+    size_t inserted = 0;
+    for (; inserted < values.size(); ++inserted) {
+      hs.insert(values[inserted]);
+      // both arrays are allocated while migrating
+      if (original.outstanding > hs.stats().slots * (1 + sizeof(Data))) {
+        break;
+      }
+    }
+    assert(inserted < values.size());
+    size_t const originalBytes = original.outstanding;
+    {
+      pmr::HashSet<Data> const copy = hs;
+      assert(original.outstanding == originalBytes);
+      assert(fallback.outstanding == copy.stats().bytes_allocated);
+      for (size_t i = 0; i <= inserted; ++i) {
+        assert(copy.contains(values[i]));
+      }
+    }
+    assert(fallback.outstanding == 0);
+  }
+  std::pmr::set_default_resource(previous);
+}
+
+// Erase and reinsert in a pmr table whose arena has already handed out an
+// odd-sized block, so that it would give byte-aligned arrays if asked for them.
+// The arena starts with room for every array the table grows through.
+void RunUnalignedArenaTestCode(std::vector<Data> const& values) {
+  std::pmr::monotonic_buffer_resource resource{values.size() * 128};
+  (void)resource.allocate(3, 1);
+  pmr::HashSet<Data> hs(&resource);
+  for (Data const& val : values) {
+    hs.insert(val);
+  }
+  for (size_t i = 0; i < values.size(); i += 2) {
+    assert(hs.erase(values[i]));
+  }
+  for (size_t i = 0; i < values.size(); i += 2) {
+    hs.insert(values[i]);
+  }
+  assert(hs.size() == values.size());
+  for (Data const& val : values) {
+    assert(hs.contains(val));
+  }
+}
+
+// Check stats() against what a table went through, and time sampling it.
+void RunStatsTestCode(std::vector<Data> const& values) {
+  HashSet<Data> hs;
+  for (Data const& val : values) {
+    hs.insert(val);
+  }
+  size_t const erased = values.size() / 4;
+  for (size_t i = 0; i < erased; ++i) {
+    hs.erase(values[i]);
+  }
+  HashSet<Data>::Stats stats;
+  {
+    Timer timer{"Flat HashSet stats()"};
+    stats = hs.stats();
+  }
+  size_t entries = 0;
+  size_t groups = 0;
+  for (size_t full = 0; full < stats.group_occupancy.size(); ++full) {
+    entries += full * stats.group_occupancy[full];
+    groups += stats.group_occupancy[full];
+  }
+  assert(entries == values.size() - erased);
+  assert(stats.entries == entries);
+  assert(groups * HashSet<Data>::GroupSize == stats.slots);
+  assert(stats.tombstones <= erased);
+  assert(stats.load_factor <= HashSet<Data>::MaxLoadFactor);
+  assert(stats.longest_probe_run <= stats.groups_without_empty);
+  std::cout << "Flat HashSet stats: " << stats.bytes_per_entry
+            << " bytes per entry, load factor " << stats.load_factor << ", "
+            << stats.tombstones << " tombstones, longest probe run "
+            << stats.longest_probe_run << " groups\n";
+}
+
+// Compare rebuilding a table by inserting everything with saving it and
+// loading the image back, and check that damaged images are rejected.
+void RunSaveLoadTestCode(std::vector<Data> const& values) {
+  char const* const path = "hash_set_image.bin";
+  HashSet<Data> hs;
+  {
+    Timer timer{"Flat HashSet rebuild by inserting"};
+    for (Data const& val : values) {
+      hs.insert(val);
+    }
+  }
+  {
+    Timer timer{"Flat HashSet save"};
+    assert(hs.save(path));
+  }
+  std::optional<HashSet<Data>> loaded;
+  {
+    Timer timer{"Flat HashSet load"};
+    loaded = HashSet<Data>::load(path);
+  }
+  assert(loaded && loaded->size() == values.size());
+  for (Data const& val : values) {
+    assert(loaded->contains(val));
+  }
+  // Damage the image: write it back with its entry size changed, truncated,
+  // and with group counts that overflow the image length (cut down to the
+  // wrapped length) or that the file is far too short for.
+  std::FILE* file = std::fopen(path, "rb");
+  std::fseek(file, 0, SEEK_END);
+  std::vector<char> bytes(std::ftell(file));
+  std::rewind(file);
+  assert(std::fread(bytes.data(), 1, bytes.size(), file) == bytes.size());
+  std::fclose(file);
+  using ImageHeader = HashSet<Data>::ImageHeader;
+  for (size_t const damage : {0, 1, 2, 3}) {
+    std::vector<char> damaged = bytes;
+    if (damage == 0) {
+      damaged[offsetof(ImageHeader, entrySize)]++;
+    } else if (damage == 1) {
+      damaged.pop_back();
+    } else {
+      uint64_t const groupCount = damage == 2 ? (1ull << 60) + 1 : 1ull << 40;
+      std::memcpy(&damaged[offsetof(ImageHeader, groupCount)], &groupCount,
+                  sizeof(groupCount));
+      if (damage == 2) {
+        damaged.resize(sizeof(ImageHeader) + 16 * (1 + sizeof(Data)));
+      }
+    }
+    file = std::fopen(path, "wb");
+    std::fwrite(damaged.data(), 1, damaged.size(), file);
+    std::fclose(file);
+    assert(!HashSet<Data>::load(path));
+  }
+  std::remove(path);
+  assert(!HashSet<Data>::load(path));
+}
+
+// Serve lookups straight from a mapped image, against the heap table it was
+// saved from.
+void RunMappedTestCode(std::vector<Data> const& values) {
+  char const* const path = "hash_set_mapped.bin";
+  HashSet<Data> hs;
+  hs.build_from_unique(values);
+  assert(hs.save(path));
+  std::optional<MappedHashSet<Data>> mapped;
+  {
+    Timer timer{"MappedHashSet open"};
+    mapped = MappedHashSet<Data>::open(path);
+  }
+  // the mapping outlives the file's name
+  std::remove(path);
+  assert(mapped && mapped->size() == values.size());
+  {
+    Timer timer{"MappedHashSet contains"};
+    for (Data const& val : values) {
+      assert(mapped->contains(val));
+    }
+  }
+  {
+    Timer timer{"Flat HashSet contains"};
+    for (Data const& val : values) {
+      assert(hs.contains(val));
+    }
+  }
+  assert(!mapped->contains({-1, -1, 0.0}));
+  assert(!MappedHashSet<Data>::open(path));
+  // An empty table's one-group image, with a group count whose image length
+  // wraps around to exactly that.
+  assert(HashSet<Data>().save(path));
+  uint64_t const groupCount = (1ull << 60) + 1;
+  std::FILE* file = std::fopen(path, "r+b");
+  std::fseek(file, offsetof(HashSet<Data>::ImageHeader, groupCount), SEEK_SET);
+  std::fwrite(&groupCount, sizeof(groupCount), 1, file);
+  std::fclose(file);
+  assert(!MappedHashSet<Data>::open(path));
+  std::remove(path);
+}
+
+// Fill a persistent set across several growths, flush it, and check that
+// reopening it finds exactly what was flushed, after unflushed changes and
+// after the flushed generation is damaged.
+void RunPersistentTestCode(std::vector<Data> const& values) {
+  std::string const path = "hash_set_persistent";
+  PersistentHashSet<Data>::remove(path);
+  size_t const half = values.size() / 2;
+  {
+    auto set = PersistentHashSet<Data>::open(path);
+    assert(set && set->size() == 0);
+    Timer timer{"PersistentHashSet insert + flush"};
+    for (size_t i = 0; i < half; ++i) {
+      assert(set->insert(values[i]));
+    }
+    assert(!set->insert(values[0]));
+    assert(set->flush());
+  }
+  {
+    auto set = PersistentHashSet<Data>::open(path);
+    assert(set && set->size() == half);
+    for (size_t i = 0; i < half; ++i) {
+      assert(set->contains(values[i]));
+    }
+    // not flushed, so dropped on reopening
+    assert(set->erase(values[0]));
+    for (size_t i = half; i < values.size(); ++i) {
+      set->insert(values[i]);
+    }
+  }
+  {
+    auto set = PersistentHashSet<Data>::open(path);
+    assert(set && set->size() == half);
+    for (size_t i = 0; i < half; ++i) {
+      assert(set->contains(values[i]));
+    }
+  }
+  // Damage the header of the one flushed generation left: opening fails
+  // rather than starting over, and keeps the file.
+  std::string file;
+  for (auto const& entry : std::filesystem::directory_iterator(".")) {
+    if (entry.path().filename().string().starts_with(path + ".")) {
+      assert(file.empty());
+      file = entry.path().string();
+    }
+  }
+  std::FILE* image = std::fopen(file.c_str(), "r+b");
+  assert(image != nullptr);
+  std::fseek(image, offsetof(HashSet<Data>::ImageHeader, entrySize), SEEK_SET);
+  std::fputc(0x7F, image);
+  std::fclose(image);
+  assert(!PersistentHashSet<Data>::open(path));
+  assert(std::filesystem::exists(file));
+  PersistentHashSet<Data>::remove(path);
+}
+
+// An entry of `Size` bytes, identified by its first field.
+template <size_t Size>
+struct Record {
+  Data key;
+  char payload[Size - sizeof(Data)];
+
+  bool operator==(Record const& other) const { return key == other.key; }
+  size_t hash() const noexcept { return key.hash(); }
+};
+
+// Insert, look up and erase `values` as Records of `Size` bytes, stored
+// inline in a HashSet and out of line in an OutOfLineHashSet.
+template <size_t Size>
+void BenchmarkOutOfLine(std::vector<Data> const& values) {
+  std::vector<Record<Size>> records(values.size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    records[i].key = values[i];
+  }
+  auto const run = [&](auto& container, char const* name) {
+    std::string const label = std::string(name) + ", " +
+                              std::to_string(Size) + "-byte entries";
+    Timer timer{label.c_str()};
+    for (Record<Size> const& record : records) {
+      container.insert(record);
+    }
+    for (Record<Size> const& record : records) {
+      assert(container.contains(record));
+    }
+    for (Record<Size> const& record : records) {
+      assert(container.erase(record));
+    }
+    assert(container.size() == 0);
+  };
+  HashSet<Record<Size>> inline_;
+  run(inline_, "Flat HashSet inline");
+  OutOfLineHashSet<Record<Size>> outOfLine;
+  run(outOfLine, "OutOfLineHashSet");
+}
+
+// Forwards to `Base`, recording the most bytes it held at once.
+template <typename Base>
+struct PeakTrackingAllocator {
+  using value_type = std::byte;
+  template <typename U>
+  struct rebind {
+    using other = PeakTrackingAllocator;
+  };
+  struct Usage {
+    size_t held = 0;
+    size_t peak = 0;
+
+    void add(ptrdiff_t bytes) {
+      held += bytes;
+      peak = std::max(peak, held);
+    }
+  };
+
+  explicit PeakTrackingAllocator(Usage* usage) : usage(usage) {}
+
+  std::byte* allocate(size_t size) {
+    usage->add(size);
+    return base.allocate(size);
+  }
+  void deallocate(std::byte* data, size_t size) {
+    usage->add(-ptrdiff_t(size));
+    base.deallocate(data, size);
+  }
+  std::byte* reallocate(std::byte* data, size_t size, size_t newSize)
+    requires requires(Base base) { base.reallocate(data, size, newSize); }
+  {
+    usage->add(ptrdiff_t(newSize) - ptrdiff_t(size));
+    return base.reallocate(data, size, newSize);
+  }
+  bool operator==(PeakTrackingAllocator const&) const { return true; }
+
+  Base base;
+  Usage* usage;
+};
+
+// Grow a table to hold `values` by rehashing into new arrays, and by growing
+// in place with mremap, and compare the peak memory each held.
+template <typename Base>
+void BenchmarkGrowthPeak(std::vector<Data> const& values, char const* name) {
+  using Allocator = PeakTrackingAllocator<Base>;
+  typename Allocator::Usage usage;
+  HashSet<Data, 2.0, Allocator> hs(4, 1, Allocator(&usage));
+  {
+    std::string const label = std::string("Flat HashSet growth, ") + name;
+    Timer timer{label.c_str()};
+    for (Data const& val : values) {
+      hs.insert(val);
+    }
+  }
+  for (Data const& val : values) {
+    assert(hs.contains(val));
+  }
+  std::cout << "Flat HashSet growth, " << name << ": peak " << usage.peak
+            << " bytes for a final " << usage.held << "\n";
+}
+
+// A key whose equality is equality of its bytes, so it opts into bitwise key
+// comparison. Data doesn't: 0.0 and -0.0 compare equal as its z.
+struct BitwiseKey {
+  int64_t a;
+  int64_t b;
+
+  static constexpr bool bitwise_comparable = true;
+
+  bool operator==(BitwiseKey const& other) const {
+    return other.a == a && other.b == b;
+  }
+
+  size_t hash() const noexcept {
+    size_t result = 0;
+    boost::hash_combine(result, a);
+    boost::hash_combine(result, b);
+    return result;
+  }
+};
+
+void RunBitwiseCompareTestCode() {
+  static_assert(is_bitwise_comparable_v<BitwiseKey>);
+  static_assert(!is_bitwise_comparable_v<Data>);
+  HashSet<BitwiseKey> keys;
+  for (int64_t i = 0; i < 1000; ++i) {
+    assert(keys.insert({i, -i}));
+  }
+  for (int64_t i = 0; i < 1000; ++i) {
+    assert(keys.contains({i, -i}));
+    assert(!keys.contains({-i - 1, i}));
+  }
+  HashSet<Data> hs;
+  hs.insert({1, 2, 0.0});
+  assert(hs.contains({1, 2, 0.0}));
+  assert(hs.contains({1, 2, -0.0}));
+}
+
 // TODO: variations of testing:
 //   - randomized insert/contains/erase
 //   - larger data
@@ -56,8 +1021,11 @@ void RandomizedTest(Container& container, std::vector<Data> const& values) {
 int main(int argc, char** argv) {
   size_t const datasetSize = std::stoi(argv[1]);
   auto const values = GenerateDataset(datasetSize);
+  auto const uniqueValues = GenerateUniqueDataset(datasetSize);
   srand(time(0));
 
+  RunBitwiseCompareTestCode();
+
   // Flat HashSet implementation
   {
     Timer timer{"Flat HashSet implementation"};
@@ -65,6 +1033,79 @@ int main(int argc, char** argv) {
     RunTestCode(hs, values);
   }
 
+  // Flat HashSet with batched erase
+  {
+    Timer timer{"Flat HashSet erase_batch"};
+    HashSet<Data> hs;
+    RunEraseBatchTestCode(hs, values);
+  }
+
+  // Flat HashSet bulk loaded from unique values
+  {
+    Timer timer{"Flat HashSet build_from_unique"};
+    HashSet<Data> hs;
+    RunBuildFromUniqueTestCode(hs, uniqueValues);
+  }
+
+  RunCountingTestCode(values);
+  RunStatsTestCode(uniqueValues);
+  RunShrinkTestCode(uniqueValues);
+  RunUnalignedArenaTestCode(uniqueValues);
+  RunCopyDuringMigrationTestCode(uniqueValues);
+  RunSaveLoadTestCode(uniqueValues);
+  RunMappedTestCode(uniqueValues);
+  RunPersistentTestCode(uniqueValues);
+
+  // Flat HashSet with caller-driven prefetching
+  {
+    Timer timer{"Flat HashSet prefetch + contains"};
+    HashSet<Data> hs;
+    RunSplitPhaseLookupTestCode(hs, values);
+  }
+
+  BenchmarkParallelRehash(uniqueValues);
+  // Large tables show off the parallel paths, but scaling them with the
+  // dataset would need gigabytes at 1e7; past a few hundred MB, stay at the
+  // dataset size.
+  BenchmarkParallelInit(
+      std::max(datasetSize, std::min<size_t>(64 * datasetSize, 1 << 24)),
+      uniqueValues);
+  BenchmarkParallelScan(GenerateUniqueDataset(
+      std::max(datasetSize, std::min<size_t>(16 * datasetSize, 1 << 22))));
+  BenchmarkShortLivedSets(uniqueValues, 10000);
+  BenchmarkGrowthFactor<1.25>(uniqueValues);
+  BenchmarkGrowthFactor<1.5>(uniqueValues);
+  BenchmarkGrowthFactor<2.0>(uniqueValues);
+  BenchmarkOutOfLine<32>(uniqueValues);
+  BenchmarkOutOfLine<64>(uniqueValues);
+  BenchmarkOutOfLine<128>(uniqueValues);
+  BenchmarkOutOfLine<256>(uniqueValues);
+  BenchmarkOutOfLine<512>(uniqueValues);
+  BenchmarkGrowthPeak<std::allocator<std::byte>>(uniqueValues,
+                                                 "rehash into new arrays");
+  BenchmarkGrowthPeak<MremapAllocator<std::byte>>(uniqueValues,
+                                                  "in place with mremap");
+  BenchmarkInsertLatency(uniqueValues);
+
+  BenchmarkConcurrent<ConcurrentHashSet<Data>>("ConcurrentHashSet",
+                                               uniqueValues);
+
+  BenchmarkConcurrent<StripedHashSet<Data>>("StripedHashSet", uniqueValues);
+  BenchmarkStripedIngest(uniqueValues);
+  {
+    Timer timer{"StripedHashSet insert/erase churn"};
+    RunStripedChurnTestCode(2'000'000);
+  }
+  BenchmarkInsertOnlyDedup(uniqueValues);
+  BenchmarkReadMostly<SingleWriterHashSet<Data>>("SingleWriterHashSet",
+                                                 uniqueValues);
+  {
+    Timer timer{"SnapshotHashSet batched updates, 4 readers"};
+    RunSnapshotTestCode(uniqueValues, 4);
+  }
+  BenchmarkReadMostly<ConcurrentHashSet<Data>>("ConcurrentHashSet",
+                                               uniqueValues);
+
   // std::unordered_set implementation
   {
     Timer timer{"std::unordered_set implementation"};